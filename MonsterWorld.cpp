@@ -3,8 +3,24 @@
 #include <vector>
 #include <iomanip>
 #include <algorithm>
+#include <fstream>
 #include <sstream>
 #include <map>
+#include <deque>
+#include <queue>
+#include <cstdint>
+#include <limits>
+#include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <chrono>
 
 using namespace std;
 
@@ -13,37 +29,624 @@ enum WeaponType { SWORD, BOMB, ARROW };
 string warriorNames[] = { "dragon", "ninja", "iceman", "lion", "wolf" };
 string weaponNames[] = { "sword", "bomb", "arrow" };
 
-int initialLife[5], initialAttack[5];
-int M, N, K, T;
+enum EventKind { BORN, RAN_AWAY, MARCHED, REACHED, STOLE, DRAW, KILLED, BOTH_DIED, HQ_REPORT, WEAPON_REPORT };
+const int eventTypes[] = { 0, 1, 2, 2, 4, 5, 5, 5, 8, 9 };
+
+class TextBuffer;
 
 struct Event {
     int time;
     int city;
-    int type;
-    string message;
+    EventKind kind;
+    bool isRed;
+    WarriorType actorType;
+    int actorId;
+    WarriorType targetType;
+    int targetId;
+    int hp;
+    int force;
+    int loyalty;
+    WeaponType weapon;
+    int weapons[3];
 
-    Event(int t, int c, int tp, const string& msg) : time(t), city(c), type(tp), message(msg) {}
+    int type() const {
+        return eventTypes[kind];
+    }
 
     bool operator<(const Event& other) const {
         if (time != other.time) return time < other.time;
-        if (type != other.type) return type < other.type;
+        if (type() != other.type()) return type() < other.type();
         if (city != other.city) return city < other.city;
-        return message > other.message;
+        return isRed && !other.isRed;
+    }
+
+    void format(TextBuffer& out) const;
+};
+
+const string sideNames[] = { "blue", "red" };
+const string warriorLabels[2][5] = {
+    { "blue dragon ", "blue ninja ", "blue iceman ", "blue lion ", "blue wolf " },
+    { "red dragon ", "red ninja ", "red iceman ", "red lion ", "red wolf " }
+};
+
+class TextBuffer {
+public:
+    static const size_t FLUSH_SIZE = 1 << 16;
+
+    TextBuffer() : cachedTime(-1), timeLength(0) {}
+
+    void put(char c) {
+        text.push_back(c);
+    }
+
+    void put(const string& s) {
+        text.append(s);
+    }
+
+    void put(const char* s, size_t n) {
+        text.append(s, n);
+    }
+
+    void putInt(int value) {
+        char digits[12];
+        int n = 0;
+        unsigned v = value < 0 ? 0u - static_cast<unsigned>(value) : value;
+        do {
+            digits[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        if (value < 0) text.push_back('-');
+        while (n > 0) text.push_back(digits[--n]);
+    }
+
+    void putTime(int time) {
+        if (time != cachedTime) {
+            cachedTime = time;
+            int hours = time / 60;
+            timeLength = 0;
+            char digits[12];
+            int n = 0;
+            do {
+                digits[n++] = '0' + hours % 10;
+                hours /= 10;
+            } while (hours || n < 3);
+            while (n > 0) timeText[timeLength++] = digits[--n];
+            timeText[timeLength++] = ':';
+            timeText[timeLength++] = '0' + time % 60 / 10;
+            timeText[timeLength++] = '0' + time % 10;
+            timeText[timeLength++] = ' ';
+        }
+        text.append(timeText, timeLength);
+    }
+
+    size_t size() const {
+        return text.size();
+    }
+
+    void flush(ostream& os) {
+        if (text.empty()) return;
+        os.write(text.data(), text.size());
+        text.clear();
+    }
+
+private:
+    string text;
+    int cachedTime;
+    char timeText[16];
+    int timeLength;
+};
+
+void formatYell(TextBuffer& out, int time, bool isRed, int id, int city) {
+    out.put('\n');
+    out.putTime(time);
+    out.put(warriorLabels[isRed][DRAGON]);
+    out.putInt(id);
+    out.put(" yelled in city ", 16);
+    out.putInt(city);
+}
+
+void Event::format(TextBuffer& out) const {
+    const string& actor = warriorLabels[isRed][actorType];
+    const string& enemySide = sideNames[!isRed];
+    out.putTime(time);
+    switch (kind) {
+        case BORN:
+            out.put(actor);
+            out.putInt(actorId);
+            out.put(" born", 5);
+            if (actorType == LION) {
+                out.put("\nIts loyalty is ", 16);
+                out.putInt(loyalty);
+            }
+            break;
+        case RAN_AWAY:
+            out.put(actor);
+            out.putInt(actorId);
+            out.put(" ran away", 9);
+            break;
+        case MARCHED:
+            out.put(actor);
+            out.putInt(actorId);
+            out.put(" marched to city ", 17);
+            out.putInt(city);
+            out.put(" with ", 6);
+            out.putInt(hp);
+            out.put(" elements and force ", 20);
+            out.putInt(force);
+            break;
+        case REACHED:
+            out.put(actor);
+            out.putInt(actorId);
+            out.put(" reached ", 9);
+            out.put(enemySide);
+            out.put(" headquarter with ", 18);
+            out.putInt(hp);
+            out.put(" elements and force ", 20);
+            out.putInt(force);
+            out.put('\n');
+            out.putTime(time);
+            out.put(enemySide);
+            out.put(" headquarter was taken", 22);
+            break;
+        case STOLE:
+            out.put(sideNames[isRed]);
+            out.put(" wolf ", 6);
+            out.putInt(actorId);
+            out.put(" took ", 6);
+            out.putInt(weapons[weapon]);
+            out.put(' ');
+            out.put(weaponNames[weapon]);
+            out.put(" from ", 6);
+            out.put(warriorLabels[!isRed][targetType]);
+            out.putInt(targetId);
+            out.put(" in city ", 9);
+            out.putInt(city);
+            break;
+        case DRAW:
+            out.put("both ", 5);
+            out.put(warriorLabels[1][actorType]);
+            out.putInt(actorId);
+            out.put(" and ", 5);
+            out.put(warriorLabels[0][targetType]);
+            out.putInt(targetId);
+            out.put(" were alive in city ", 20);
+            out.putInt(city);
+            if (actorType == DRAGON) formatYell(out, time, true, actorId, city);
+            if (targetType == DRAGON) formatYell(out, time, false, targetId, city);
+            break;
+        case KILLED:
+            out.put(actor);
+            out.putInt(actorId);
+            out.put(" killed ", 8);
+            out.put(warriorLabels[!isRed][targetType]);
+            out.putInt(targetId);
+            out.put(" in city ", 9);
+            out.putInt(city);
+            out.put(" remaining ", 11);
+            out.putInt(hp);
+            out.put(" elements", 9);
+            if (actorType == DRAGON) formatYell(out, time, isRed, actorId, city);
+            break;
+        case BOTH_DIED:
+            out.put("both ", 5);
+            out.put(warriorLabels[1][actorType]);
+            out.putInt(actorId);
+            out.put(" and ", 5);
+            out.put(warriorLabels[0][targetType]);
+            out.putInt(targetId);
+            out.put(" died in city ", 14);
+            out.putInt(city);
+            break;
+        case HQ_REPORT:
+            out.putInt(hp);
+            out.put(" elements in ", 13);
+            out.put(sideNames[isRed]);
+            out.put(" headquarter", 12);
+            break;
+        case WEAPON_REPORT:
+            out.put(actor);
+            out.putInt(actorId);
+            out.put(" has ", 5);
+            out.putInt(weapons[SWORD]);
+            out.put(" sword ", 7);
+            out.putInt(weapons[BOMB]);
+            out.put(" bomb ", 6);
+            out.putInt(weapons[ARROW]);
+            out.put(" arrow and ", 11);
+            out.putInt(hp);
+            out.put(" elements", 9);
+            break;
+    }
+    out.put('\n');
+}
+
+struct EventFilter {
+    static const unsigned ALL_KINDS = (1u << (WEAPON_REPORT + 1)) - 1;
+
+    unsigned kinds;
+    bool red;
+    bool blue;
+    int cityLo;
+    int cityHi;
+    vector<int> ids;
+
+    EventFilter() : kinds(ALL_KINDS), red(true), blue(true), cityLo(0), cityHi(numeric_limits<int>::max()) {}
+
+    bool wants(EventKind kind) const {
+        return kinds >> kind & 1;
+    }
+
+    bool passesAll() const {
+        return kinds == ALL_KINDS && red && blue && cityLo == 0 && cityHi == numeric_limits<int>::max() && ids.empty();
+    }
+
+    bool parseKinds(const string& list) {
+        kinds = 0;
+        istringstream names(list);
+        string name;
+        while (getline(names, name, ',')) {
+            if (name == "born") kinds |= 1u << BORN;
+            else if (name == "escape") kinds |= 1u << RAN_AWAY;
+            else if (name == "march") kinds |= 1u << MARCHED;
+            else if (name == "reach") kinds |= 1u << REACHED;
+            else if (name == "steal") kinds |= 1u << STOLE;
+            else if (name == "battle") kinds |= 1u << DRAW | 1u << KILLED | 1u << BOTH_DIED;
+            else if (name == "hq") kinds |= 1u << HQ_REPORT;
+            else if (name == "weapons") kinds |= 1u << WEAPON_REPORT;
+            else return false;
+        }
+        return true;
+    }
+
+    bool accepts(const Event& e, int N) const {
+        if (!wants(e.kind)) return false;
+        bool hasTarget = e.kind == STOLE || e.kind == DRAW || e.kind == KILLED || e.kind == BOTH_DIED;
+        if (!(e.isRed ? red : blue) && !(hasTarget && (e.isRed ? blue : red))) return false;
+        int city = e.kind == BORN && !e.isRed ? N + 1 : e.city;
+        if (city < cityLo || city > cityHi) return false;
+        if (ids.empty()) return true;
+        if (e.kind == HQ_REPORT) return false;
+        return find(ids.begin(), ids.end(), e.actorId) != ids.end()
+            || (hasTarget && find(ids.begin(), ids.end(), e.targetId) != ids.end());
+    }
+};
+
+class EventLogWriter {
+public:
+    explicit EventLogWriter(ostream& out) : out(out) {}
+
+    static void writeHeader(ostream& out) {
+        out.write("MWLOG1", 6);
+    }
+
+    void beginCase(int cas) {
+        out.put(static_cast<char>(CASE_MARK));
+        putVarint(cas);
+    }
+
+    void write(const Event& e) {
+        out.put(static_cast<char>(e.kind));
+        putVarint(e.time);
+        putVarint(e.city);
+        out.put(static_cast<char>(e.isRed));
+        switch (e.kind) {
+            case HQ_REPORT:
+                putVarint(e.hp);
+                return;
+            default:
+                break;
+        }
+        out.put(static_cast<char>(e.actorType));
+        putVarint(e.actorId);
+        switch (e.kind) {
+            case BORN:
+                if (e.actorType == LION) putVarint(e.loyalty);
+                break;
+            case MARCHED:
+            case REACHED:
+                putVarint(e.hp);
+                putVarint(e.force);
+                break;
+            case STOLE:
+                out.put(static_cast<char>(e.weapon));
+                putVarint(e.weapons[e.weapon]);
+                putTarget(e);
+                break;
+            case KILLED:
+                putVarint(e.hp);
+                putTarget(e);
+                break;
+            case DRAW:
+            case BOTH_DIED:
+                putTarget(e);
+                break;
+            case WEAPON_REPORT:
+                putVarint(e.weapons[SWORD]);
+                putVarint(e.weapons[BOMB]);
+                putVarint(e.weapons[ARROW]);
+                putVarint(e.hp);
+                break;
+            default:
+                break;
+        }
+    }
+
+    static const int CASE_MARK = 0xff;
+
+private:
+    ostream& out;
+
+    void putVarint(int value) {
+        uint32_t v = static_cast<uint32_t>(value);
+        while (v >= 0x80) {
+            out.put(static_cast<char>(v | 0x80));
+            v >>= 7;
+        }
+        out.put(static_cast<char>(v));
+    }
+
+    void putTarget(const Event& e) {
+        out.put(static_cast<char>(e.targetType));
+        putVarint(e.targetId);
+    }
+};
+
+class EventLogReader {
+public:
+    explicit EventLogReader(istream& in, bool header = true) : in(in), valid(true) {
+        if (!header) return;
+        char magic[6];
+        in.read(magic, 6);
+        valid = in.good() && string(magic, 6) == "MWLOG1";
+    }
+
+    bool good() const {
+        return valid;
+    }
+
+    bool next(Event& e, int& cas) {
+        int kind;
+        if (!valid || (kind = in.get()) == EOF) return false;
+        cas = 0;
+        if (kind == EventLogWriter::CASE_MARK) {
+            cas = getVarint();
+            return valid;
+        }
+        if (kind > WEAPON_REPORT) {
+            valid = false;
+            return false;
+        }
+        e = Event();
+        e.kind = static_cast<EventKind>(kind);
+        e.time = getVarint();
+        e.city = getVarint();
+        e.isRed = in.get() != 0;
+        if (e.kind != HQ_REPORT) {
+            e.actorType = static_cast<WarriorType>(getByte(DRAGON, WOLF));
+            e.actorId = getVarint();
+        }
+        switch (e.kind) {
+            case BORN:
+                if (e.actorType == LION) e.loyalty = getVarint();
+                break;
+            case RAN_AWAY:
+                break;
+            case MARCHED:
+            case REACHED:
+                e.hp = getVarint();
+                e.force = getVarint();
+                break;
+            case STOLE:
+                e.weapon = static_cast<WeaponType>(getByte(SWORD, ARROW));
+                e.weapons[e.weapon] = getVarint();
+                getTarget(e);
+                break;
+            case KILLED:
+                e.hp = getVarint();
+                getTarget(e);
+                break;
+            case DRAW:
+            case BOTH_DIED:
+                getTarget(e);
+                break;
+            case HQ_REPORT:
+                e.hp = getVarint();
+                break;
+            case WEAPON_REPORT:
+                e.weapons[SWORD] = getVarint();
+                e.weapons[BOMB] = getVarint();
+                e.weapons[ARROW] = getVarint();
+                e.hp = getVarint();
+                break;
+            default:
+                valid = false;
+                break;
+        }
+        if (!in) valid = false;
+        return valid;
+    }
+
+    bool render(ostream& os) {
+        TextBuffer text;
+        Event e;
+        int cas;
+        while (next(e, cas)) {
+            if (text.size() >= TextBuffer::FLUSH_SIZE) text.flush(os);
+            if (cas) {
+                text.put("Case ", 5);
+                text.putInt(cas);
+                text.put(":\n", 2);
+            } else {
+                e.format(text);
+            }
+        }
+        text.flush(os);
+        return valid;
+    }
+
+private:
+    istream& in;
+    bool valid;
+
+    int getVarint() {
+        uint32_t v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            int c = in.get();
+            if (c == EOF) {
+                valid = false;
+                break;
+            }
+            v |= static_cast<uint32_t>(c & 0x7f) << shift;
+            if (!(c & 0x80)) break;
+        }
+        return static_cast<int>(v);
+    }
+
+    int getByte(int lo, int hi) {
+        int c = in.get();
+        if (c >= lo && c <= hi) return c;
+        valid = false;
+        return lo;
+    }
+
+    void getTarget(Event& e) {
+        e.targetType = static_cast<WarriorType>(getByte(DRAGON, WOLF));
+        e.targetId = getVarint();
+    }
+};
+
+struct SnapshotIndexEntry {
+    int cas;
+    int time;
+    uint64_t offset;
+};
+
+class SnapshotWriter {
+public:
+    explicit SnapshotWriter(ostream& out) : out(out) {}
+
+    static void writeHeader(ostream& out) {
+        out.write("MWSNAP2", 7);
+    }
+
+    void mark(int cas, int time) {
+        index.push_back(SnapshotIndexEntry{ cas, time, static_cast<uint64_t>(out.tellp()) });
+    }
+
+    void writeIndex() {
+        uint64_t start = out.tellp();
+        put(index.size());
+        for (auto& entry : index) {
+            put(entry.cas);
+            put(entry.time);
+            putFixed(entry.offset);
+        }
+        putFixed(start);
+        out.write("MWIDX1", 6);
+    }
+
+    void put(int value) {
+        uint32_t v = (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+        while (v >= 0x80) {
+            out.put(static_cast<char>(v | 0x80));
+            v >>= 7;
+        }
+        out.put(static_cast<char>(v));
+    }
+
+private:
+    ostream& out;
+    vector<SnapshotIndexEntry> index;
+
+    void putFixed(uint64_t v) {
+        for (int i = 0; i < 8; i++)
+            out.put(static_cast<char>(v >> (8 * i)));
     }
 };
 
-vector<Event> events;
+class SnapshotReader {
+public:
+    explicit SnapshotReader(istream& in, bool header = true) : in(in), valid(true) {
+        if (!header) return;
+        char magic[7];
+        in.read(magic, 7);
+        valid = in.good() && string(magic, 7) == "MWSNAP2";
+    }
+
+    static bool readIndex(istream& in, vector<SnapshotIndexEntry>& index) {
+        char magic[6];
+        in.seekg(-14, ios::end);
+        uint64_t start = getFixed(in);
+        in.read(magic, 6);
+        if (!in || string(magic, 6) != "MWIDX1") return false;
+        in.seekg(start);
+        SnapshotReader reader(in, false);
+        int n = reader.get(0, numeric_limits<int>::max());
+        index.clear();
+        for (int i = 0; i < n && reader.good(); i++) {
+            SnapshotIndexEntry entry;
+            entry.cas = reader.get();
+            entry.time = reader.get();
+            entry.offset = getFixed(in);
+            index.push_back(entry);
+        }
+        return reader.good() && in.good();
+    }
+
+    bool good() const {
+        return valid;
+    }
+
+    bool atEnd() {
+        return in.peek() == EOF;
+    }
+
+    int get() {
+        uint32_t v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            int c = in.get();
+            if (c == EOF) {
+                valid = false;
+                break;
+            }
+            v |= static_cast<uint32_t>(c & 0x7f) << shift;
+            if (!(c & 0x80)) break;
+        }
+        return static_cast<int>((v >> 1) ^ (0u - (v & 1)));
+    }
+
+    int get(int lo, int hi) {
+        int v = get();
+        if (v < lo || v > hi) valid = false;
+        return v;
+    }
+
+private:
+    istream& in;
+    bool valid;
+
+    static uint64_t getFixed(istream& in) {
+        uint64_t v = 0;
+        for (int i = 0; i < 8; i++)
+            v |= static_cast<uint64_t>(static_cast<unsigned char>(in.get())) << (8 * i);
+        return v;
+    }
+};
 
 class Weapon {
 public:
     WeaponType type;
     int durability;
 
+    Weapon() : type(SWORD), durability(0) {}
+
     Weapon(WeaponType type) : type(type) {
         if (type == ARROW) durability = 2;
         else durability = 1;
     }
 
+    Weapon(WeaponType type, int durability) : type(type), durability(durability) {}
+
     bool isUsable() const {
         return durability > 0;
     }
@@ -71,196 +674,263 @@ public:
 
 };
 
-class Warrior {
+class Inventory {
 public:
-    int id;
-    int hp;
-    int attackPower;
-    int city;
-    bool isRed;
-    WarriorType type;
-    vector<Weapon*> weapons;
-    int nextweapon;
-    int loyalty;
+    int swords;
+    int bombs;
+    int usedArrows;
+    int freshArrows;
 
-    Warrior(int id, int hp, int attackpower, int city, bool isRed, WarriorType type)
-        : id(id), hp(hp), attackPower(attackpower), city(city), isRed(isRed), type(type), nextweapon(0) {};
+    Inventory() : swords(0), bombs(0), usedArrows(0), freshArrows(0) {}
 
-    virtual ~Warrior() {
-        for(auto w : weapons)
-            delete w;
+    int size() const {
+        return swords + bombs + usedArrows + freshArrows;
     }
 
-    void sortWeapons() {
-        sort(weapons.begin(), weapons.end(), [](Weapon* a, Weapon* b) {
-            if (a->type != b->type) return a->type < b->type;
-            if (a->type == ARROW) return a->durability < b->durability;
-            return false;
-        });
-        nextweapon = 0;
+    bool empty() const {
+        return size() == 0;
     }
 
-    bool hasWeapons() const {
-        for (auto w : weapons) {
-            if (w->isUsable()) return true;
+    int count(WeaponType type) const {
+        switch (type) {
+            case SWORD: return swords;
+            case BOMB: return bombs;
+            case ARROW: return usedArrows + freshArrows;
+            default: return 0;
         }
-        return false;
     }
 
-    virtual void move() {
-        if (isRed) city++;
-        else city--;
+    int add(const Weapon& w, int n = 1) {
+        n = min(n, 10 - size());
+        if (w.type == SWORD) swords += n;
+        else if (w.type == BOMB) bombs += n;
+        else if (w.durability == 2) freshArrows += n;
+        else usedArrows += n;
+        return n;
     }
 
-    virtual void afterMove() {}
-
-    virtual bool checkEscape() {
-        if (type != LION) return false;
-        if (city == 0 || city == N + 1) return false;
-        return loyalty <= 0;
+    void removeAll(WeaponType type) {
+        if (type == SWORD) swords = 0;
+        else if (type == BOMB) bombs = 0;
+        else usedArrows = freshArrows = 0;
     }
+};
 
-    virtual void beforeBattle(Warrior* enemy, int time) {
-        if (enemy != nullptr) {}
-        if (time) {}
+class Arsenal {
+public:
+    Weapon slots[10];
+    int count;
+    int next;
+    int consumables;
+
+    explicit Arsenal(const Inventory& inv) : count(0), next(0), consumables(inv.size() - inv.swords) {
+        fill(Weapon(SWORD), inv.swords);
+        fill(Weapon(BOMB), inv.bombs);
+        fill(Weapon(ARROW, 1), inv.usedArrows);
+        fill(Weapon(ARROW, 2), inv.freshArrows);
     }
 
-    void sortWeaponsForLoot() {
-        sort(weapons.begin(), weapons.end(), [](Weapon* a, Weapon* b) {
-            if (a->type != b->type) return a->type < b->type;
-            if (a->type == ARROW) return a->durability > b->durability;
-            return false;
-        });
+    bool hasWeapons() const {
+        return count > 0;
     }
 
-    void loot(Warrior* enemy) {
-        vector<Weapon*> loot;
-        enemy->sortWeaponsForLoot();
-        for (auto w : enemy->weapons) {
-            loot.push_back(w);
-        }
-        enemy->weapons.clear();
+    void erase(int idx) {
+        if (slots[idx].type != SWORD) consumables--;
+        for (int i = idx + 1; i < count; i++)
+            slots[i - 1] = slots[i];
+        count--;
+    }
 
-        for (auto w : loot) {
-            if (weapons.size() >= 10) {
-                delete w;
-                continue;
-            }
-            weapons.push_back(w);
-        }
-        sortWeapons();
+    Inventory inventory() const {
+        Inventory inv;
+        for (int i = 0; i < count; i++)
+            inv.add(slots[i]);
+        return inv;
     }
 
-    string reportWeapons() {
-        map<WeaponType, int> counts;
-        for (auto w : weapons) {
-            if (w->isUsable())
-                counts[w->type]++;
-        }
-        stringstream ss;
-        ss << counts[SWORD] << " " << weaponNames[SWORD] << " ";
-        ss << counts[BOMB] << " " << weaponNames[BOMB] << " ";
-        ss << counts[ARROW] << " " << weaponNames[ARROW];
-        return ss.str();
+private:
+    void fill(const Weapon& w, int n) {
+        while (n-- > 0)
+            slots[count++] = w;
     }
 };
 
-class Dragon : public Warrior {
-public:
-    Dragon(int id, int hp, int attack, bool isRed, int city)
-        : Warrior(id, hp, attack, city, isRed, DRAGON) {
-        weapons.push_back(new Weapon(static_cast<WeaponType>(id % 3)));
-    }
-    
-    virtual void afterMove() {}
+template<WarriorType Type>
+struct Behavior {
+    static int hpLoss(int) { return 0; }
+    static int loyaltyLoss(int) { return 0; }
 };
-    
-class Ninja : public Warrior {
-public:
-    Ninja(int id, int hp, int attack, bool isRed, int city)
-        : Warrior(id, hp, attack, city, isRed, NINJA) {
-        weapons.push_back(new Weapon(static_cast<WeaponType>(id % 3)));
-        weapons.push_back(new Weapon(static_cast<WeaponType>((id + 1) % 3)));
-    }
-    
-    virtual void afterMove() {}
+
+template<>
+struct Behavior<ICEMAN> {
+    static int hpLoss(int hp) { return hp / 10; }
+    static int loyaltyLoss(int) { return 0; }
+};
+
+template<>
+struct Behavior<LION> {
+    static int hpLoss(int) { return 0; }
+    static int loyaltyLoss(int K) { return K; }
 };
-    
-class Iceman : public Warrior {
+
+class WarriorTable {
 public:
-    Iceman(int id, int hp, int attack, bool isRed, int city)
-        : Warrior(id, hp, attack, city, isRed, ICEMAN) {
-        weapons.push_back(new Weapon(static_cast<WeaponType>(id % 3)));
+    vector<int> id;
+    vector<int> hp;
+    vector<int> attackPower;
+    vector<int> city;
+    vector<char> isRed;
+    vector<WarriorType> type;
+    vector<int> loyalty;
+    vector<Inventory> weapons;
+    vector<char> alive;
+
+    WarriorTable() : liveCount(0) {}
+
+    int size() const {
+        return id.size();
     }
 
-    virtual void afterMove() {
-        hp -= hp / 10;
+    int live() const {
+        return liveCount;
     }
-};
-    
-class Lion : public Warrior {
-public:
-    Lion(int id, int hp, int attack, bool isRed, int city, int loyalty)
-        : Warrior(id, hp, attack, city, isRed, LION){
-            this->loyalty = loyalty;
-        weapons.push_back(new Weapon(static_cast<WeaponType>(id % 3)));
+
+    int add(int wid, int whp, int attack, int wcity, bool red, WarriorType wtype, int wloyalty) {
+        int w;
+        if (freeSlots.empty()) {
+            w = size();
+            resize(w + 1);
+        } else {
+            w = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        id[w] = wid;
+        hp[w] = whp;
+        attackPower[w] = attack;
+        city[w] = wcity;
+        isRed[w] = red;
+        type[w] = wtype;
+        loyalty[w] = wloyalty;
+        weapons[w] = Inventory();
+        alive[w] = 1;
+        liveCount++;
+        return w;
     }
-    
-    virtual bool checkEscape() {
-        if (city == 0 || city == N + 1) return false;
-        return loyalty <= 0;
+
+    void kill(int w) {
+        weapons[w] = Inventory();
+        alive[w] = 0;
     }
-    
-    virtual void afterMove() {
-        loyalty -= K;
+
+    void release(int w) {
+        freeSlots.push_back(w);
+        liveCount--;
     }
-};
-    
-class Wolf : public Warrior {
-public:
-    Wolf(int id, int hp, int attack, bool isRed, int city)
-        : Warrior(id, hp, attack, city, isRed, WOLF) {}
-    
-    virtual void beforeBattle(Warrior* enemy, int time) {
-        if (enemy->type == WOLF) return;
-        if (enemy->weapons.empty()) return;
-    
-        WeaponType minType = enemy->weapons[0]->type;
-        for (auto w : enemy->weapons) {
-            if (w->type < minType) minType = w->type;
-        }
-    
-        vector<Weapon*> stolen;
-        auto it = enemy->weapons.begin();
-        while (it != enemy->weapons.end()) {
-            if ((*it)->type == minType) {
-                stolen.push_back(*it);
-                it = enemy->weapons.erase(it);
-            } else {
-                ++it;
-            }
+
+    void remove(int w) {
+        kill(w);
+        release(w);
+    }
+
+    void clear() {
+        resize(0);
+        freeSlots.clear();
+        liveCount = 0;
+    }
+
+    void moveAll() {
+        int n = size();
+        for (int w = 0; w < n; w++)
+            city[w] += alive[w] ? (isRed[w] ? 1 : -1) : 0;
+    }
+
+    template<WarriorType Type>
+    void afterMove(int K) {
+        int n = size();
+        for (int w = 0; w < n; w++) {
+            bool match = type[w] == Type && alive[w];
+            hp[w] -= match ? Behavior<Type>::hpLoss(hp[w]) : 0;
+            loyalty[w] -= match ? Behavior<Type>::loyaltyLoss(K) : 0;
         }
-    
-        sort(stolen.begin(), stolen.end(), [](Weapon* a, Weapon* b) {
-            if (a->type == ARROW && b->type == ARROW) return a->durability > b->durability;
-            return false;
-        });
-        
-        int num = 0;
-        for (auto w : stolen) {
-            if (weapons.size() >= 10) {
-                delete w;
-            } else {
-                weapons.push_back(w);
-                num++;
-            }
+    }
+
+    void save(SnapshotWriter& out) const {
+        out.put(size());
+        for (int w = 0; w < size(); w++) {
+            out.put(alive[w]);
+            if (!alive[w]) continue;
+            out.put(id[w]);
+            out.put(hp[w]);
+            out.put(attackPower[w]);
+            out.put(city[w]);
+            out.put(isRed[w]);
+            out.put(type[w]);
+            out.put(loyalty[w]);
+            out.put(weapons[w].swords);
+            out.put(weapons[w].bombs);
+            out.put(weapons[w].usedArrows);
+            out.put(weapons[w].freshArrows);
         }
-        string msg = (isRed ? "red " : "blue ") + string("wolf ") + to_string(id) + " took " + to_string(num) + " " + string(weaponNames[minType]) + " from " + (isRed ? "blue " : "red ") + string(warriorNames[enemy->type]) + " " + to_string(enemy->id) + " in city " + to_string(city);
-        events.emplace_back(time, city, 4, msg);
-        sortWeapons();
+        out.put(freeSlots.size());
+        for (int w : freeSlots)
+            out.put(w);
+    }
+
+    bool load(SnapshotReader& in) {
+        clear();
+        int n = in.get(0, numeric_limits<int>::max());
+        if (!in.good()) return false;
+        for (int w = 0; w < n && in.good(); w++) {
+            resize(w + 1);
+            alive[w] = in.get(0, 1);
+            if (!alive[w]) continue;
+            id[w] = in.get();
+            hp[w] = in.get();
+            attackPower[w] = in.get();
+            city[w] = in.get();
+            isRed[w] = in.get(0, 1);
+            type[w] = static_cast<WarriorType>(in.get(DRAGON, WOLF));
+            loyalty[w] = in.get();
+            weapons[w].swords = in.get(0, 10);
+            weapons[w].bombs = in.get(0, 10);
+            weapons[w].usedArrows = in.get(0, 10);
+            weapons[w].freshArrows = in.get(0, 10);
+        }
+        int freeCount = in.get(0, n);
+        for (int i = 0; i < freeCount && in.good(); i++)
+            freeSlots.push_back(in.get(0, n - 1));
+        liveCount = n - freeCount;
+        return in.good();
+    }
+
+    void loot(int w, int enemy) {
+        Inventory& spoils = weapons[enemy];
+        weapons[w].add(Weapon(SWORD), spoils.swords);
+        weapons[w].add(Weapon(BOMB), spoils.bombs);
+        weapons[w].add(Weapon(ARROW, 2), spoils.freshArrows);
+        weapons[w].add(Weapon(ARROW, 1), spoils.usedArrows);
+        spoils = Inventory();
+    }
+
+private:
+    vector<int> freeSlots;
+    int liveCount;
+
+    void resize(int n) {
+        id.resize(n);
+        hp.resize(n);
+        attackPower.resize(n);
+        city.resize(n);
+        isRed.resize(n);
+        type.resize(n);
+        loyalty.resize(n);
+        weapons.resize(n);
+        alive.resize(n);
     }
 };
 
+class World;
+
 class Headquarters {
     public:
         int life;
@@ -270,421 +940,2115 @@ class Headquarters {
         int totalId;
         bool stopped;
         bool istaken;
-        vector<Warrior*> warriors;
-    
+
         Headquarters(int life, const vector<WarriorType>& order, bool isRed)
             : life(life), productionOrder(order), isRed(isRed), nextId(0), totalId(1), stopped(false), istaken(false) {}
-    
-        ~Headquarters() {
-            for (auto w : warriors) {
-                if(!w) delete w;
-            }
-        }
-    
-        Warrior* produce() {
-            if (stopped) return nullptr;
-            WarriorType type = productionOrder[nextId];
-            int cost = initialLife[type];
-            if (life >= cost) {
-                life -= cost;
-                Warrior* w = createWarrior(totalId++, type);
-                warriors.push_back(w);
-                nextId = (nextId + 1) % 5;
-                return w;
-            } else {
-                stopped = true;
-            return nullptr;
-            }
+
+        void reset(int initialLife) {
+            life = initialLife;
+            nextId = 0;
+            totalId = 1;
+            stopped = false;
+            istaken = false;
         }
-    
+
+        int produce(World& world);
+        int spawn(World& world, WarriorType type);
+
 private:
-    Warrior* createWarrior(int id, WarriorType type) {
-        int hp = initialLife[type];
-        int attack = initialAttack[type];
-        int city = isRed ? 0 : N + 1;
-        switch (type) {
-            case DRAGON:
-                return new Dragon(id, hp, attack, isRed, city);
-            case NINJA:
-                return new Ninja(id, hp, attack, isRed, city);
-            case ICEMAN:
-                return new Iceman(id, hp, attack, isRed, city);
-            case LION:
-                return new Lion(id, hp, attack, isRed, city, life);
-            case WOLF:
-                return new Wolf(id, hp, attack, isRed, city);
-            default:
-                return nullptr;
-        }
-    }
+    int createWarrior(World& world, int id, WarriorType type);
 };
-    
-Headquarters* redHQ = nullptr;
-Headquarters* blueHQ = nullptr;
-vector<Warrior*> redWarriors, blueWarriors;
-map<int, pair<Warrior*, Warrior*>> cityWarriors;
 
-void produceWarriors(int time) {
-    Warrior* red = redHQ->produce();
-    if (red) {
-        stringstream ss;
-        ss << (redHQ->isRed ? "red " : "blue ") << string(warriorNames[red->type]) << " " << to_string(red->id) << " born";
-        if (red->type == LION) {
-            ss << endl << "Its loyalty is " << to_string(red->loyalty);
-        }
-        events.emplace_back(time, 0, 0, ss.str());
-        redWarriors.push_back(red);
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads) : head(0), stopping(false) {
+        for (int i = 0; i < threads; i++)
+            workers.emplace_back([this] { work(); });
     }
 
-    Warrior* blue = blueHQ->produce();
-    if (blue) {
-        stringstream ss;
-        ss << (blueHQ->isRed ? "red " : "blue ") << string(warriorNames[blue->type]) << " " << to_string(blue->id) << " born";
-        if (blue->type == LION) {
-            ss << endl << "Its loyalty is " << to_string(blue->loyalty);
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
         }
-        events.emplace_back(time, 0, 0, ss.str());
-        blueWarriors.push_back(blue);
+        cv.notify_all();
+        for (auto& t : workers)
+            t.join();
     }
-}
 
-void clearWarrior(Warrior * w) {
-    auto deleteWarrior = [](Warrior * w, bool isRed) {
-        if (isRed) {
-                redWarriors.erase(remove(redWarriors.begin(), redWarriors.end(), w), redWarriors.end());
-                redHQ->warriors.erase(remove(redHQ->warriors.begin(), redHQ->warriors.end(), w), redHQ->warriors.end());
-                delete w;
-        } else {
-                blueWarriors.erase(remove(blueWarriors.begin(), blueWarriors.end(), w), blueWarriors.end());
-                blueHQ->warriors.erase(remove(blueHQ->warriors.begin(), blueHQ->warriors.end(), w), blueHQ->warriors.end());
-                delete w;
+    int size() const {
+        return workers.size();
+    }
+
+    template<class F>
+    future<decltype(declval<F>()())> submit(F f) {
+        typedef packaged_task<decltype(f())()> Task;
+        Task* task = new Task(move(f));
+        auto result = task->get_future();
+        {
+            lock_guard<mutex> lock(m);
+            jobs.push_back(Job{[](void* ctx, int) {
+                Task* task = static_cast<Task*>(ctx);
+                (*task)();
+                delete task;
+            }, task, 0, nullptr});
         }
-    };
+        cv.notify_one();
+        return result;
+    }
 
-    deleteWarrior(w, w->isRed);
-}
+    // Runs body(0) .. body(count - 1) on the workers and waits for all of them.
+    // Nothing is allocated once the job list has grown to its working size.
+    template<class F>
+    void forEach(int count, F& body) {
+        int pending = count;
+        unique_lock<mutex> lock(m);
+        for (int i = 0; i < count; i++)
+            jobs.push_back(Job{[](void* ctx, int i) { (*static_cast<F*>(ctx))(i); }, &body, i, &pending});
+        cv.notify_all();
+        finished.wait(lock, [&pending] { return pending == 0; });
+    }
 
-void checkLionEscape(int time) {
-    auto check = [time](vector<Warrior*>& warriors, bool isRed) {
-        vector<Warrior*> toRemove;
-        for (auto& w : warriors) {
-            if (w->type == LION && w->checkEscape()) {
-                string msg = (isRed ? "red " : "blue ") + string(warriorNames[w->type]) + " " + to_string(w->id) + " ran away";
-                events.emplace_back(time, w->city, 1, msg);
-                toRemove.push_back(w);
-            }
-        }
-        for (auto w : toRemove) {
-            warriors.erase(remove(warriors.begin(), warriors.end(), w), warriors.end());
-            delete w;
-        }
+private:
+    struct Job {
+        void (*run)(void*, int);
+        void* ctx;
+        int index;
+        int* pending;
     };
 
-    check(redWarriors, true);
-    check(blueWarriors, false);
-}
+    vector<thread> workers;
+    vector<Job> jobs;
+    size_t head;
+    mutex m;
+    condition_variable cv;
+    condition_variable finished;
+    bool stopping;
+
+    void work() {
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> lock(m);
+                cv.wait(lock, [this] { return stopping || head < jobs.size(); });
+                if (head == jobs.size()) return;
+                job = jobs[head++];
+                if (head == jobs.size()) {
+                    jobs.clear();
+                    head = 0;
+                }
+            }
+            job.run(job.ctx, job.index);
+            if (job.pending) {
+                lock_guard<mutex> lock(m);
+                if (--*job.pending == 0) finished.notify_all();
+            }
+        }
+    }
+};
+
+template<class T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots(capacity), mask(capacity - 1), head(0), tail(0) {}
 
-void moveWarriors(int time) {
-    cityWarriors.clear();
-    auto moveSingle = [time](vector<Warrior*>& warriors, bool isRed) {
+    bool tryPush(const T& item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == slots.size()) return false;
+        slots[t & mask] = item;
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
 
-        for (auto w : warriors) {
-            w->move();
-            w->afterMove();
+    bool tryPop(T& item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) return false;
+        item = slots[h & mask];
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
 
-            if ((isRed && w->city == N + 1) || (!isRed && w->city == 0)) {
-                if ((isRed && w->city == N + 1)) {
-                    blueHQ->istaken = true;
-                    stringstream ss;
-                    ss << "red " + string(warriorNames[w->type]) + " " + to_string(w->id) + " reached blue headquarter with " + to_string(w->hp) + " elements and force " + to_string(w->attackPower);
-                    ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60 << " blue headquarter was taken";
-                    events.emplace_back(time, w->city, 2, ss.str());
-                }
-                if ((!isRed && w->city == 0)) {
-                    redHQ->istaken = true;
-                    stringstream ss;
-                    ss << "blue " + string(warriorNames[w->type]) + " " + to_string(w->id) + " reached red headquarter with " + to_string(w->hp) + " elements and force " + to_string(w->attackPower);
-                    ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60 << " red headquarter was taken";
-                    events.emplace_back(time, w->city, 2, ss.str());
-                }
+private:
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head;
+    alignas(64) atomic<size_t> tail;
+};
+
+void backoff(int& spins) {
+    if (++spins < 64) {
+        this_thread::yield();
+    } else {
+        this_thread::sleep_for(chrono::microseconds(50));
+    }
+}
+
+class AsyncWriter {
+public:
+    static const size_t RING_SIZE = 1 << 14;
+
+    AsyncWriter(ostream& out, bool binary)
+        : out(out), binary(binary), ring(RING_SIZE), finished(false), consumer([this] { run(); }) {}
+
+    ~AsyncWriter() {
+        finished.store(true, memory_order_release);
+        consumer.join();
+    }
+
+    void beginCase(int cas) {
+        push(Record{ cas, Event() });
+    }
+
+    void write(const Event& e) {
+        push(Record{ 0, e });
+    }
+
+private:
+    struct Record {
+        int cas;
+        Event event;
+    };
+
+    ostream& out;
+    bool binary;
+    SpscRing<Record> ring;
+    atomic<bool> finished;
+    thread consumer;
+
+    void push(const Record& r) {
+        int spins = 0;
+        while (!ring.tryPush(r))
+            backoff(spins);
+    }
+
+    void run() {
+        EventLogWriter log(out);
+        TextBuffer text;
+        Record r;
+        int spins = 0;
+        while (true) {
+            bool done = finished.load(memory_order_acquire);
+            if (!ring.tryPop(r)) {
+                if (done) break;
+                backoff(spins);
                 continue;
             }
+            spins = 0;
+            if (r.cas && binary) {
+                log.beginCase(r.cas);
+            } else if (r.cas) {
+                text.put("Case ", 5);
+                text.putInt(r.cas);
+                text.put(":\n", 2);
+            } else if (binary) {
+                log.write(r.event);
+            } else {
+                r.event.format(text);
+                if (text.size() >= TextBuffer::FLUSH_SIZE) text.flush(out);
+            }
+        }
+        text.flush(out);
+    }
+};
 
-            string msg = (isRed ? "red " : "blue ") + string(warriorNames[w->type]) + " " + to_string(w->id) + " marched to city " + to_string(w->city) + " with " + to_string(w->hp) + " elements and force " + to_string(w->attackPower);
-            events.emplace_back(time, w->city, 2, msg);
+enum Phase { PRODUCE, LION_ESCAPE, MOVE, WOLF_STEAL, BATTLES, HQ_REPORTS, WEAPON_REPORTS, OUTPUT, STEADY_STATE, PHASE_COUNT };
+const char* phaseNames[] = { "produceWarriors", "checkLionEscape", "moveWarriors", "resolveWolfSteal", "resolveBattles", "reportHeadquarters", "reportWeapons", "output", "detectSteadyState" };
+const Phase kindPhases[] = { PRODUCE, LION_ESCAPE, MOVE, MOVE, WOLF_STEAL, BATTLES, BATTLES, BATTLES, HQ_REPORTS, WEAPON_REPORTS };
+
+struct RunStats {
+    double seconds[PHASE_COUNT];
+    long long calls[PHASE_COUNT];
+    long long events[PHASE_COUNT];
+    long long eventTypes[10];
+    long long battles;
+    long long battleRounds;
+    long long warriorsCreated;
+    long long warriorsDestroyed;
+    long long weaponsCreated;
+    long long weaponsDestroyed;
+    long long peakEvents;
+    long long extrapolatedHours;
+    long long cacheHits;
+
+    RunStats() {
+        fill(seconds, seconds + PHASE_COUNT, 0.0);
+        fill(calls, calls + PHASE_COUNT, 0LL);
+        fill(events, events + PHASE_COUNT, 0LL);
+        fill(eventTypes, eventTypes + 10, 0LL);
+        battles = battleRounds = 0;
+        warriorsCreated = warriorsDestroyed = 0;
+        weaponsCreated = weaponsDestroyed = 0;
+        peakEvents = 0;
+        extrapolatedHours = 0;
+        cacheHits = 0;
+    }
 
-            cityWarriors[w->city].first = isRed ? w : cityWarriors[w->city].first;
-            cityWarriors[w->city].second = !isRed ? w : cityWarriors[w->city].second;
+    void merge(const RunStats& other) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            seconds[p] += other.seconds[p];
+            calls[p] += other.calls[p];
+            events[p] += other.events[p];
         }
-    };
+        for (int t = 0; t < 10; t++)
+            eventTypes[t] += other.eventTypes[t];
+        battles += other.battles;
+        battleRounds += other.battleRounds;
+        warriorsCreated += other.warriorsCreated;
+        warriorsDestroyed += other.warriorsDestroyed;
+        weaponsCreated += other.weaponsCreated;
+        weaponsDestroyed += other.weaponsDestroyed;
+        peakEvents = max(peakEvents, other.peakEvents);
+        extrapolatedHours += other.extrapolatedHours;
+        cacheHits += other.cacheHits;
+    }
 
-    moveSingle(redWarriors, true);
-    moveSingle(blueWarriors, false);
+    void writeJson(ostream& os) const {
+        os << "\"phases\":{";
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            os << (p ? "," : "") << "\"" << phaseNames[p] << "\":{\"calls\":" << calls[p]
+               << ",\"seconds\":" << seconds[p] << ",\"events\":" << events[p] << "}";
+        }
+        os << "},\"events\":{";
+        bool first = true;
+        for (int type : { 0, 1, 2, 4, 5, 8, 9 }) {
+            os << (first ? "" : ",") << "\"" << type << "\":" << eventTypes[type];
+            first = false;
+        }
+        os << "},\"battles\":" << battles << ",\"battleRounds\":" << battleRounds
+           << ",\"warriors\":{\"created\":" << warriorsCreated << ",\"destroyed\":" << warriorsDestroyed << "}"
+           << ",\"weapons\":{\"created\":" << weaponsCreated << ",\"destroyed\":" << weaponsDestroyed << "}"
+           << ",\"peakEvents\":" << peakEvents << ",\"extrapolatedHours\":" << extrapolatedHours
+           << ",\"cacheHits\":" << cacheHits;
+    }
+};
+
+class TraceWriter {
+public:
+    typedef chrono::steady_clock::time_point TimePoint;
+
+    explicit TraceWriter(ostream& out) : out(out), origin(chrono::steady_clock::now()), first(true), threads(0) {
+        out << "{\"traceEvents\":[\n";
+    }
+
+    ~TraceWriter() {
+        out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    }
+
+    void complete(const string& name, const char* category, TimePoint start, TimePoint end,
+                  initializer_list<pair<const char*, long long>> args = {}) {
+        ostringstream line;
+        line << fixed << setprecision(3) << "{\"name\":\"" << name << "\",\"cat\":\"" << category
+             << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << thread() << ",\"ts\":" << micros(start)
+             << ",\"dur\":" << micros(end) - micros(start) << ",\"args\":{";
+        bool firstArg = true;
+        for (auto& arg : args) {
+            line << (firstArg ? "" : ",") << "\"" << arg.first << "\":" << arg.second;
+            firstArg = false;
+        }
+        line << "}}";
+        lock_guard<mutex> lock(m);
+        out << (first ? "" : ",\n") << line.str();
+        first = false;
+    }
+
+private:
+    ostream& out;
+    TimePoint origin;
+    bool first;
+    atomic<int> threads;
+    mutex m;
+
+    int thread() {
+        static thread_local int id = -1;
+        if (id < 0) id = threads++;
+        return id;
+    }
+
+    double micros(TimePoint t) const {
+        return chrono::duration<double, micro>(t - origin).count();
+    }
+};
+
+class PhaseTimer {
+public:
+    PhaseTimer(RunStats* stats, Phase phase, TraceWriter* trace = nullptr, int time = 0)
+        : stats(stats), phase(phase), trace(trace), time(time) {
+        if (stats || trace) start = chrono::steady_clock::now();
+    }
+
+    ~PhaseTimer() {
+        if (!stats && !trace) return;
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        if (trace) trace->complete(phaseNames[phase], "phase", start, end, { { "time", time } });
+        if (!stats) return;
+        stats->seconds[phase] += chrono::duration<double>(end - start).count();
+        stats->calls[phase]++;
+    }
+
+private:
+    RunStats* stats;
+    Phase phase;
+    TraceWriter* trace;
+    int time;
+    chrono::steady_clock::time_point start;
+};
+
+struct CaseParams {
+    int M = 0, N = 0, K = 0, T = 0;
+    int initialLife[5] = {};
+    int initialAttack[5] = {};
+    WarriorType redOrder[5] = { ICEMAN, LION, WOLF, NINJA, DRAGON };
+    WarriorType blueOrder[5] = { LION, DRAGON, NINJA, ICEMAN, WOLF };
+};
+
+struct Outcome {
+    bool redTaken;
+    bool blueTaken;
+    int captureTime;
+    int redAlive;
+    int blueAlive;
+    long long battles;
+
+    Outcome() : redTaken(false), blueTaken(false), captureTime(-1), redAlive(0), blueAlive(0), battles(0) {}
+};
+
+uint64_t fnv1a(const vector<int>& values) {
+    uint64_t h = 14695981039346656037ull;
+    for (int v : values) {
+        for (int i = 0; i < 4; i++) {
+            h ^= static_cast<uint32_t>(v) >> (8 * i) & 0xff;
+            h *= 1099511628211ull;
+        }
+    }
+    return h;
 }
 
-void resolveWolfSteal(int time) {
-    for (auto& entry : cityWarriors) {
-        Warrior* red = entry.second.first;
-        Warrior* blue = entry.second.second;
+struct SteadyState {
+    static constexpr int MAX_PERIOD = 60;
+    static constexpr int MAX_BACKOFF = 1024;
+
+    deque<uint64_t> keys;
+    vector<int> key, signature, current;
+    int period = 0;
+    int minPeriod = 1;
+    int start = 0;
+    int misses = 0;
+    int skip = 0;
+    long long hourBattles = 0;
+    int life[2] = {}, totalId[2] = {};
+    int dLife[2] = {}, dId[2] = {};
+    vector<int> hourLife[2], hourNext[2];
+    long long battles = 0;
+    RunStats stats;
+    vector<Event> events;
+
+    void reset() {
+        keys.clear();
+        period = 0;
+        events.clear();
+    }
+
+    void miss() {
+        minPeriod = period < MAX_PERIOD ? period + 1 : 1;
+        reset();
+        misses++;
+        skip = min(1 << min(misses, 10), MAX_BACKOFF);
+    }
+
+    void clear() {
+        reset();
+        minPeriod = 1;
+        misses = skip = 0;
+        hourBattles = 0;
+    }
+
+    int repeatedLag() const {
+        int n = keys.size();
+        for (int p = minPeriod; 2 * p <= n; p++) {
+            int j = 1;
+            while (j <= p && keys[n - j] == keys[n - j - p]) j++;
+            if (j > p) return p;
+        }
+        return 0;
+    }
+};
+
+class World {
+public:
+    int M, N, K, T;
+    int initialLife[5], initialAttack[5];
+    vector<Event> events;
+    WarriorTable warriors;
+    Headquarters redHQ;
+    Headquarters blueHQ;
+    vector<pair<int, int>> cityWarriors;
+    ThreadPool* battlePool;
+    RunStats* stats;
+    SnapshotWriter* snapshot;
+    int snapshotAt;
+    int snapshotEvery;
+    bool silent;
+    Outcome outcome;
+    EventFilter filter;
+    AsyncWriter* async;
+    TraceWriter* trace;
+    function<void(const Event&)> onEvent;
+
+    explicit World(const CaseParams& params, ThreadPool* battlePool = nullptr)
+        : M(params.M), N(params.N), K(params.K), T(params.T),
+          redHQ(params.M, vector<WarriorType>(params.redOrder, params.redOrder + 5), true),
+          blueHQ(params.M, vector<WarriorType>(params.blueOrder, params.blueOrder + 5), false),
+          battlePool(battlePool), stats(nullptr), snapshot(nullptr), snapshotAt(-1), snapshotEvery(0), silent(false), async(nullptr), trace(nullptr),
+          nextTime(0), idle(false), clock(-1) {
+        copy(params.initialLife, params.initialLife + 5, initialLife);
+        copy(params.initialAttack, params.initialAttack + 5, initialAttack);
+    }
+
+    void reset(const CaseParams& params) {
+        M = params.M;
+        N = params.N;
+        K = params.K;
+        T = params.T;
+        copy(params.initialLife, params.initialLife + 5, initialLife);
+        copy(params.initialAttack, params.initialAttack + 5, initialAttack);
+        redHQ.reset(M);
+        blueHQ.reset(M);
+        redHQ.productionOrder.assign(params.redOrder, params.redOrder + 5);
+        blueHQ.productionOrder.assign(params.blueOrder, params.blueOrder + 5);
+        warriors.clear();
+        events.clear();
+        cityWarriors.clear();
+        outcome = Outcome();
+        steady.clear();
+        nextTime = 0;
+        idle = false;
+        clock = -1;
+    }
+
+    int time() const {
+        return clock;
+    }
+
+    bool finished() const {
+        return nextTime > T;
+    }
+
+    void runUntil(int until);
+    void step(int minutes);
+    void simulate(int cas, ostream& out, EventLogWriter* log);
+    bool replay(int cas, istream& recorded, ostream& out, EventLogWriter* log);
+    void describe(TextBuffer& out, int time, int cityLo, int cityHi) const;
+    void save(SnapshotWriter& out, int cas, int time) const;
+    bool load(SnapshotReader& in, int& cas, int& time);
+
+    Event& addEvent(int time, int city, EventKind kind) {
+        return addEvent(events, time, city, kind);
+    }
+
+    Event& addEvent(vector<Event>& out, int time, int city, EventKind kind) {
+        static thread_local Event discarded;
+        if (!filter.wants(kind)) return discarded;
+        out.emplace_back();
+        Event& e = out.back();
+        e.time = time;
+        e.city = city;
+        e.kind = kind;
+        return e;
+    }
+
+    Event& record(int w, int time, int where, EventKind kind, int target = -1) {
+        return record(events, w, time, where, kind, target);
+    }
 
-        if (red && blue) {
-            if (red->type == WOLF) red->beforeBattle(blue, time);
-            if (blue->type == WOLF) blue->beforeBattle(red, time);
+    Event& record(vector<Event>& out, int w, int time, int where, EventKind kind, int target = -1) {
+        Event& e = addEvent(out, time, where, kind);
+        e.isRed = warriors.isRed[w];
+        e.actorType = warriors.type[w];
+        e.actorId = warriors.id[w];
+        e.hp = warriors.hp[w];
+        e.force = warriors.attackPower[w];
+        e.loyalty = warriors.loyalty[w];
+        if (target >= 0) {
+            e.targetType = warriors.type[target];
+            e.targetId = warriors.id[target];
         }
+        return e;
+    }
+
+    bool checkEscape(int w) const {
+        if (warriors.type[w] != LION) return false;
+        if (warriors.city[w] == 0 || warriors.city[w] == N + 1) return false;
+        return warriors.loyalty[w] <= 0;
+    }
+
+    void wolfSteal(int w, int enemy, int time, vector<Event>& out);
+
+private:
+    void produceWarriors(int time);
+    void checkLionEscape(int time);
+    void moveWarriors(int time);
+    void resolveWolfSteal(int time);
+    int fight(int a, int b, int city, int time, vector<Event>& out);
+    void resolveBattles(int time);
+    template<class F> void forEachContestedCity(F resolve);
+    void reportHeadquarters(int time);
+    void reportWeapons(int time);
+    void runPhase(Phase phase, int time);
+    void emit(const Event& e, EventLogWriter* log);
+    void flushEvents(ostream& out, EventLogWriter* log);
+    bool hasWork(int minutes) const;
+    int nextTick(int t) const;
+    int reportIdleHours(int from, int to, ostream& out, EventLogWriter* log);
+    bool steadySignature(vector<int>& sig) const;
+    int steadyPeriods(int t, int until);
+    int steadyBound(long long k);
+    void extrapolate(int t, int periods, ostream& out, EventLogWriter* log);
+    void beginCase(int cas, EventLogWriter* log);
+    void runTicks(int cas, int until, ostream& out, EventLogWriter* log);
+    int tick(int cas, int t, ostream& out, EventLogWriter* log);
+    int finishTick(int cas, int t, Phase phase, ostream& out, EventLogWriter* log);
+    void updateOutcome();
+    void endCase(ostream& out);
+
+    friend bool queryReplay(const string& path, int cas, int time, int cityLo, int cityHi, ostream& os);
+
+    int nextTime;
+    bool idle;
+    int clock;
+
+    long long warriorsBefore, weaponsBefore;
+    vector<int> contested;
+    vector<vector<Event>> battleBuffers;
+    TextBuffer text;
+    SteadyState steady;
+};
+
+int Headquarters::produce(World& world) {
+    if (stopped) return -1;
+    WarriorType type = productionOrder[nextId];
+    int cost = world.initialLife[type];
+    if (life >= cost) {
+        life -= cost;
+        nextId = (nextId + 1) % 5;
+        return spawn(world, type);
+    } else {
+        stopped = true;
+        return -1;
     }
 }
 
-void fight(Warrior* a, Warrior* b, int city, int time) {
-    a->sortWeapons();
-    b->sortWeapons();
+int Headquarters::spawn(World& world, WarriorType type) {
+    int w = createWarrior(world, totalId++, type);
+    if (world.stats) {
+        world.stats->warriorsCreated++;
+        world.stats->weaponsCreated += world.warriors.weapons[w].size();
+    }
+    return w;
+}
 
-    bool aFirst = (city % 2 == 1);
+int Headquarters::createWarrior(World& world, int id, WarriorType type) {
+    int hp = world.initialLife[type];
+    int attack = world.initialAttack[type];
+    int city = isRed ? 0 : world.N + 1;
+    int w = world.warriors.add(id, hp, attack, city, isRed, type, type == LION ? life : 0);
+    Inventory& weapons = world.warriors.weapons[w];
+    switch (type) {
+        case NINJA:
+            weapons.add(Weapon(static_cast<WeaponType>(id % 3)));
+            weapons.add(Weapon(static_cast<WeaponType>((id + 1) % 3)));
+            break;
+        case DRAGON:
+        case ICEMAN:
+        case LION:
+            weapons.add(Weapon(static_cast<WeaponType>(id % 3)));
+            break;
+        case WOLF:
+            break;
+    }
+    return w;
+}
 
-    Warrior* attacker = aFirst ? a : b;
-    Warrior* defender = aFirst ? b : a;
+void World::wolfSteal(int w, int enemy, int time, vector<Event>& out) {
+    Inventory& mine = warriors.weapons[w];
+    Inventory& theirs = warriors.weapons[enemy];
+    if (warriors.type[enemy] == WOLF) return;
+    if (theirs.empty()) return;
+
+    WeaponType minType = SWORD;
+    while (theirs.count(minType) == 0)
+        minType = static_cast<WeaponType>(minType + 1);
+
+    int num;
+    if (minType == ARROW) {
+        num = mine.add(Weapon(ARROW, 2), theirs.freshArrows);
+        num += mine.add(Weapon(ARROW, 1), theirs.usedArrows);
+    } else {
+        num = mine.add(Weapon(minType), theirs.count(minType));
+    }
+    theirs.removeAll(minType);
 
-    bool aHasWeapons = a->hasWeapons();
-    bool bHasWeapons = b->hasWeapons();
+    Event& e = record(out, w, time, warriors.city[w], STOLE, enemy);
+    e.weapon = minType;
+    e.weapons[minType] = num;
+}
 
-    if (!aHasWeapons && !bHasWeapons) {
-        stringstream ss;
-        ss << "both red " << warriorNames[a->type] << " " << a->id << " and blue " << warriorNames[b->type] << " " << b->id << " were alive in city " << city;
-        if (a->type == DRAGON) {
-            ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60;
-            ss << (a->isRed ? " red " : " blue ") << "dragon " << a->id << " yelled in city " << city;
+void World::produceWarriors(int time) {
+    int red = redHQ.produce(*this);
+    if (red >= 0) {
+        record(red, time, 0, BORN);
+    }
+
+    int blue = blueHQ.produce(*this);
+    if (blue >= 0) {
+        record(blue, time, 0, BORN);
+    }
+}
+
+void World::checkLionEscape(int time) {
+    for (int w = 0; w < warriors.size(); w++) {
+        if (warriors.alive[w] && checkEscape(w)) {
+            record(w, time, warriors.city[w], RAN_AWAY);
+            warriors.remove(w);
         }
-        if (b->type == DRAGON) {
-            ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60;
-            ss << (b->isRed ? " red " : " blue ") << "dragon " << b->id << " yelled in city " << city;
+    }
+}
+
+void World::moveWarriors(int time) {
+    cityWarriors.assign(N + 2, make_pair(-1, -1));
+    warriors.moveAll();
+    warriors.afterMove<ICEMAN>(K);
+    warriors.afterMove<LION>(K);
+    for (int w = 0; w < warriors.size(); w++) {
+        if (!warriors.alive[w]) continue;
+        bool isRed = warriors.isRed[w];
+        int city = warriors.city[w];
+
+        if ((isRed && city == N + 1) || (!isRed && city == 0)) {
+            if ((isRed && city == N + 1)) {
+                blueHQ.istaken = true;
+            }
+            if ((!isRed && city == 0)) {
+                redHQ.istaken = true;
+            }
+            record(w, time, city, REACHED);
+            continue;
         }
-        events.emplace_back(time, city, 5, ss.str());
+
+        record(w, time, city, MARCHED);
+
+        if (isRed) cityWarriors[city].first = w;
+        else cityWarriors[city].second = w;
+    }
+}
+
+template<class F>
+void World::forEachContestedCity(F resolve) {
+    contested.clear();
+    for (int city = 1; city <= N; city++) {
+        if (cityWarriors[city].first >= 0 && cityWarriors[city].second >= 0)
+            contested.push_back(city);
+    }
+
+    int n = contested.size();
+    if (!battlePool || n < 2) {
+        for (int city : contested)
+            resolve(city, cityWarriors[city], events);
         return;
     }
 
+    int chunks = min(n, battlePool->size());
+    if (static_cast<int>(battleBuffers.size()) < chunks) battleBuffers.resize(chunks);
+    for (int c = 0; c < chunks; c++)
+        battleBuffers[c].clear();
+    auto chunk = [&](int c) {
+        for (int i = c * n / chunks; i < (c + 1) * n / chunks; i++)
+            resolve(contested[i], cityWarriors[contested[i]], battleBuffers[c]);
+    };
+    battlePool->forEach(chunks, chunk);
+    for (int c = 0; c < chunks; c++)
+        events.insert(events.end(), battleBuffers[c].begin(), battleBuffers[c].end());
+}
+
+void World::resolveWolfSteal(int time) {
+    forEachContestedCity([this, time](int, pair<int, int>& entry, vector<Event>& out) {
+        int red = entry.first;
+        int blue = entry.second;
+        if (warriors.type[red] == WOLF) wolfSteal(red, blue, time, out);
+        if (warriors.type[blue] == WOLF) wolfSteal(blue, red, time, out);
+    });
+}
+
+int fastForwardSwords(int& attackerHp, int& defenderHp, int hit, int counter) {
+    const int never = numeric_limits<int>::max();
+    int toKillDefender = hit > 0 ? (defenderHp - 1) / hit + 1 : never;
+    int toKillAttacker = counter > 0 ? (attackerHp - 1) / counter + 1 : never;
+    if (toKillDefender <= toKillAttacker) {
+        attackerHp -= (toKillDefender - 1) * counter;
+        defenderHp = 0;
+        return toKillDefender;
+    } else {
+        defenderHp -= toKillAttacker * hit;
+        attackerHp = 0;
+        return toKillAttacker;
+    }
+}
+
+int World::fight(int a, int b, int city, int time, vector<Event>& out) {
+    WarriorTable& W = warriors;
+    Arsenal aArms(W.weapons[a]);
+    Arsenal bArms(W.weapons[b]);
+
+    bool aFirst = (city % 2 == 1);
+
+    int attacker = aFirst ? a : b;
+    int defender = aFirst ? b : a;
+    Arsenal& attackerArms = aFirst ? aArms : bArms;
+    Arsenal& defenderArms = aFirst ? bArms : aArms;
+
+    bool aHasWeapons = aArms.hasWeapons();
+    bool bHasWeapons = bArms.hasWeapons();
+
+    if (!aHasWeapons && !bHasWeapons) {
+        record(out, a, time, city, DRAW, b);
+        return 0;
+    }
+
     int count = 0;
+    int rounds = 0;
     while (true) {
-        bool aDead = (a->hp <= 0);
-        bool bDead = (b->hp <= 0);
+        bool aDead = (W.hp[a] <= 0);
+        bool bDead = (W.hp[b] <= 0);
+
+        if (aDead || bDead) {
+            W.weapons[a] = aArms.inventory();
+            W.weapons[b] = bArms.inventory();
+        }
 
         if (aDead && bDead) {
-            stringstream ss;
-            ss << "both red " << warriorNames[a->type] << " " << a->id << " and blue " << warriorNames[b->type] << " " << b->id << " died in city " << city;
-            events.emplace_back(time, city, 5, ss.str());
-            clearWarrior(a);
-            clearWarrior(b);
+            record(out, a, time, city, BOTH_DIED, b);
+            W.kill(a);
+            W.kill(b);
             break;
         } else if (aDead) {
-            stringstream ss;
-            ss << "blue " << warriorNames[b->type] << " " << b->id << " killed red " << warriorNames[a->type] << " " << a->id << " in city " << city << " remaining " << b->hp << " elements";
-            b->loot(a);
-            if (b->type == DRAGON) {
-                ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60;
-                ss << (b->isRed ? " red " : " blue ") << "dragon " << b->id << " yelled in city " << city;
-            }
-            events.emplace_back(time, city, 5, ss.str());
-            clearWarrior(a);
+            record(out, b, time, city, KILLED, a);
+            W.loot(b, a);
+            W.kill(a);
             break;
         } else if (bDead) {
-            stringstream ss;
-            ss << "red " << warriorNames[a->type] << " " << a->id << " killed blue " << warriorNames[b->type] << " " << b->id << " in city " << city << " remaining " << a->hp << " elements";
-            a->loot(b);
-            if (a->type == DRAGON) {
-                ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60;
-                ss << (a->isRed ? " red " : " blue ") << "dragon " << a->id << " yelled in city " << city;
-            }
-            events.emplace_back(time, city, 5, ss.str());
-            clearWarrior(b);
+            record(out, a, time, city, KILLED, b);
+            W.loot(a, b);
+            W.kill(b);
             break;
         }
 
-        if (!attacker->hasWeapons() && !defender->hasWeapons()) {
-            stringstream ss;
-            ss << "both red " << warriorNames[a->type] << " " << a->id << " and blue " << warriorNames[b->type] << " " << b->id << " were alive in city " << city;
-            if (a->type == DRAGON) {
-                ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60;
-                ss << (a->isRed ? " red " : " blue ") << "dragon " << a->id << " yelled in city " << city;
-            }
-            if (b->type == DRAGON) {
-                ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60;
-                ss << (b->isRed ? " red " : " blue ") << "dragon " << b->id << " yelled in city " << city;
-            }
-            events.emplace_back(time, city, 5, ss.str());
+        if (!attackerArms.hasWeapons() && !defenderArms.hasWeapons()) {
+            record(out, a, time, city, DRAW, b);
+            W.weapons[a] = aArms.inventory();
+            W.weapons[b] = bArms.inventory();
             break;
         }
 
+        if (attackerArms.consumables == 0 && defenderArms.consumables == 0) {
+            int hit = attackerArms.hasWeapons() ? Weapon(SWORD).calculateAttack(W.attackPower[attacker]) : 0;
+            int counter = defenderArms.hasWeapons() ? Weapon(SWORD).calculateAttack(W.attackPower[defender]) : 0;
+            if (hit == 0 && counter == 0) {
+                rounds += 10 - count;
+                record(out, a, time, city, DRAW, b);
+                W.weapons[a] = aArms.inventory();
+                W.weapons[b] = bArms.inventory();
+                break;
+            }
+            rounds += fastForwardSwords(W.hp[attacker], W.hp[defender], hit, counter);
+            continue;
+        }
+
         bool changed = false;
-        int aInitialHp = a->hp;
-        int bInitialHp = b->hp;
+        int aInitialHp = W.hp[a];
+        int bInitialHp = W.hp[b];
+        rounds++;
 
-        if (attacker->hasWeapons()) {
-            int k = attacker->weapons.size();
+        if (attackerArms.hasWeapons()) {
+            int k = attackerArms.count;
             for (int i = 0; i < k; i++) {
-                int idx = (attacker->nextweapon + i) % k;
-                Weapon* w = attacker->weapons[idx];
-                if (w->isUsable()) {
-                    int dmg = w->calculateAttack(attacker->attackPower);
-                    defender->hp -= dmg;
-                    defender->hp = max(defender->hp, 0);
-
-                    if (w->type == BOMB && attacker->type != NINJA) {
+                int idx = (attackerArms.next + i) % k;
+                Weapon& w = attackerArms.slots[idx];
+                if (w.isUsable()) {
+                    int dmg = w.calculateAttack(W.attackPower[attacker]);
+                    W.hp[defender] -= dmg;
+                    W.hp[defender] = max(W.hp[defender], 0);
+
+                    if (w.type == BOMB && W.type[attacker] != NINJA) {
                         int selfDmg = dmg / 2;
-                        attacker->hp -= selfDmg;
-                        attacker->hp = max(attacker->hp, 0);
+                        W.hp[attacker] -= selfDmg;
+                        W.hp[attacker] = max(W.hp[attacker], 0);
                     }
 
-                    w->use();
-                    if (!w->isUsable()) {
-                        attacker->weapons.erase(remove(attacker->weapons.begin(), attacker->weapons.end(), w), attacker->weapons.end());
-                        delete w;
+                    w.use();
+                    if (!w.isUsable()) {
+                        attackerArms.erase(idx);
                     }
 
-                    attacker->nextweapon = (idx + 1) % k;
+                    attackerArms.next = (idx + 1) % k;
                     changed = true;
                     break;
                 }
             }
         }
 
-        if (defender->hp <= 0) continue;
+        if (W.hp[defender] <= 0) continue;
 
-        if (defender->hasWeapons()) {
-            int k = defender->weapons.size();
+        if (defenderArms.hasWeapons()) {
+            int k = defenderArms.count;
             for (int i = 0; i < k; i++) {
-                int idx = (defender->nextweapon + i) % k;
-                Weapon* w = defender->weapons[idx];
-                if (w->isUsable()) {
-                    int dmg = w->calculateAttack(defender->attackPower);
-                    attacker->hp -= dmg;
-                    attacker->hp = max(attacker->hp, 0);
-
-                    if (w->type == BOMB && defender->type != NINJA) {
+                int idx = (defenderArms.next + i) % k;
+                Weapon& w = defenderArms.slots[idx];
+                if (w.isUsable()) {
+                    int dmg = w.calculateAttack(W.attackPower[defender]);
+                    W.hp[attacker] -= dmg;
+                    W.hp[attacker] = max(W.hp[attacker], 0);
+
+                    if (w.type == BOMB && W.type[defender] != NINJA) {
                         int selfDmg = dmg / 2;
-                        defender->hp -= selfDmg;
-                        defender->hp = max(defender->hp, 0);
+                        W.hp[defender] -= selfDmg;
+                        W.hp[defender] = max(W.hp[defender], 0);
                     }
 
-                    w->use();
-                    if (!w->isUsable()) {
-                        defender->weapons.erase(remove(defender->weapons.begin(), defender->weapons.end(), w), defender->weapons.end());
-                        delete w;
+                    w.use();
+                    if (!w.isUsable()) {
+                        defenderArms.erase(idx);
                     }
 
-                    defender->nextweapon = (idx + 1) % k;
+                    defenderArms.next = (idx + 1) % k;
                     changed = true;
                     break;
                 }
             }
         }
-        
-        if(a->hp == aInitialHp && b->hp == bInitialHp) count++;
+
+        if(W.hp[a] == aInitialHp && W.hp[b] == bInitialHp) count++;
         if(count >= 10) changed = false;
         if (!changed) {
-            stringstream ss;
-            ss << "both red " << warriorNames[a->type] << " " << a->id << " and blue " << warriorNames[b->type] << " " << b->id << " were alive in city " << city;
-            if (a->type == DRAGON) {
-                ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60;
-                ss << (a->isRed ? " red " : " blue ") << "dragon " << a->id << " yelled in city " << city;
-            }
-            if (b->type == DRAGON) {
-                ss << endl << setw(3) << setfill('0') << time / 60 << ":" << setw(2) << setfill('0') << time % 60;
-                ss << (b->isRed ? " red " : " blue ") << "dragon " << b->id << " yelled in city " << city;
-            }
-            events.emplace_back(time, city, 5, ss.str());
+            record(out, a, time, city, DRAW, b);
+            W.weapons[a] = aArms.inventory();
+            W.weapons[b] = bArms.inventory();
+            break;
+        }
+    }
+    return rounds;
+}
+
+void World::resolveBattles(int time) {
+    atomic<long long> battles(0), rounds(0);
+    forEachContestedCity([this, time, &battles, &rounds](int city, pair<int, int>& entry, vector<Event>& out) {
+        TraceWriter::TimePoint start = trace ? chrono::steady_clock::now() : TraceWriter::TimePoint();
+        int fought = fight(entry.first, entry.second, city, time, out);
+        if (trace) trace->complete("fight", "battle", start, chrono::steady_clock::now(), { { "city", city }, { "rounds", fought }, { "time", time } });
+        battles++;
+        if (stats) rounds += fought;
+    });
+    outcome.battles += battles;
+    if (stats) {
+        stats->battles += battles;
+        stats->battleRounds += rounds;
+    }
+
+    for (int city = 1; city <= N; city++) {
+        pair<int, int>& entry = cityWarriors[city];
+        if (entry.first >= 0 && !warriors.alive[entry.first]) {
+            warriors.release(entry.first);
+            entry.first = -1;
+        }
+        if (entry.second >= 0 && !warriors.alive[entry.second]) {
+            warriors.release(entry.second);
+            entry.second = -1;
+        }
+    }
+}
+
+void World::reportHeadquarters(int time) {
+    Event& red = addEvent(time, 0, HQ_REPORT);
+    red.isRed = true;
+    red.hp = redHQ.life;
+
+    Event& blue = addEvent(time, N + 1, HQ_REPORT);
+    blue.isRed = false;
+    blue.hp = blueHQ.life;
+}
+
+void World::reportWeapons(int time) {
+    if (cityWarriors.empty()) return;
+    for (int city = 1; city <= N; city++) {
+        for (int w : { cityWarriors[city].first, cityWarriors[city].second }) {
+            if (w < 0) continue;
+            const Inventory& inv = warriors.weapons[w];
+            Event& e = record(w, time, city, WEAPON_REPORT);
+            e.weapons[SWORD] = inv.swords;
+            e.weapons[BOMB] = inv.bombs;
+            e.weapons[ARROW] = inv.usedArrows + inv.freshArrows;
+        }
+    }
+}
+
+void World::emit(const Event& e, EventLogWriter* log) {
+    if (onEvent) onEvent(e);
+    if (async) async->write(e);
+    else if (log) log->write(e);
+    else if (!silent) e.format(text);
+}
+
+void World::flushEvents(ostream& out, EventLogWriter* log) {
+    if (silent && !stats && !onEvent) {
+        events.clear();
+        return;
+    }
+    if (!is_sorted(events.begin(), events.end())) sort(events.begin(), events.end());
+    if (steady.period) steady.events.insert(steady.events.end(), events.begin(), events.end());
+    if (stats) stats->peakEvents = max(stats->peakEvents, static_cast<long long>(events.size()));
+    for (auto& e : events) {
+        if (e.time > T || !filter.accepts(e, N)) continue;
+        if (stats) stats->eventTypes[e.type()]++;
+        emit(e, log);
+    }
+    events.clear();
+    if (text.size() >= TextBuffer::FLUSH_SIZE) text.flush(out);
+}
+
+Phase phaseAt(int minutes) {
+    switch (minutes) {
+        case 0: return PRODUCE;
+        case 5: return LION_ESCAPE;
+        case 10: return MOVE;
+        case 35: return WOLF_STEAL;
+        case 40: return BATTLES;
+        case 50: return HQ_REPORTS;
+        case 55: return WEAPON_REPORTS;
+        default: return PHASE_COUNT;
+    }
+}
+
+void World::runPhase(Phase phase, int time) {
+    switch (phase) {
+        case PRODUCE: produceWarriors(time); break;
+        case LION_ESCAPE: checkLionEscape(time); break;
+        case MOVE: moveWarriors(time); break;
+        case WOLF_STEAL: resolveWolfSteal(time); break;
+        case BATTLES: resolveBattles(time); break;
+        case HQ_REPORTS:
+            if (filter.wants(HQ_REPORT)) reportHeadquarters(time);
             break;
+        case WEAPON_REPORTS:
+            if (filter.wants(WEAPON_REPORT)) reportWeapons(time);
+            break;
+        default: break;
+    }
+}
+
+bool World::hasWork(int minutes) const {
+    switch (minutes) {
+        case 0:
+            return !redHQ.stopped || !blueHQ.stopped;
+        case 5:
+        case 10:
+        case 35:
+        case 40:
+            return warriors.live() > 0;
+        case 50:
+            return filter.wants(HQ_REPORT);
+        case 55:
+            return warriors.live() > 0 && filter.wants(WEAPON_REPORT);
+        default:
+            return false;
+    }
+}
+
+int World::nextTick(int t) const {
+    int next = t + 5;
+    while (next <= T && !hasWork(next % 60))
+        next += 5;
+    return next;
+}
+
+int World::reportIdleHours(int from, int to, ostream& out, EventLogWriter* log) {
+    if (from > to) return from;
+    reportHeadquarters(from);
+    events.erase(remove_if(events.begin(), events.end(), [this](const Event& e) { return !filter.accepts(e, N); }), events.end());
+    for (int t = from; t <= to && !events.empty(); t += 60) {
+        for (auto& e : events) {
+            e.time = t;
+            emit(e, log);
+        }
+        if (text.size() >= TextBuffer::FLUSH_SIZE) text.flush(out);
+        if (stats) {
+            stats->events[HQ_REPORTS] += events.size();
+            stats->eventTypes[eventTypes[HQ_REPORT]] += events.size();
+        }
+    }
+    events.clear();
+    return from + ((to - from) / 60 + 1) * 60;
+}
+
+bool World::steadySignature(vector<int>& sig) const {
+    long long cap = llabs(K) * (N + 1LL);
+    sig.clear();
+    sig.push_back(silent && !stats && !onEvent);
+    for (const Headquarters* hq : { &redHQ, &blueHQ }) {
+        sig.push_back(hq->stopped);
+        sig.push_back(hq->nextId);
+        sig.push_back(hq->totalId % 3);
+    }
+    int found = 0;
+    for (int city = 1; city + 1 < static_cast<int>(cityWarriors.size()); city++) {
+        for (int w : { cityWarriors[city].first, cityWarriors[city].second }) {
+            if (w < 0 || !warriors.alive[w] || warriors.city[w] != city) continue;
+            const Headquarters& hq = warriors.isRed[w] ? redHQ : blueHQ;
+            const Inventory& inv = warriors.weapons[w];
+            int loyalty = warriors.type[w] == LION ? static_cast<int>(min<long long>(warriors.loyalty[w], cap + 1)) : 0;
+            sig.insert(sig.end(), { city, warriors.isRed[w], warriors.type[w], warriors.hp[w], warriors.attackPower[w],
+                                    hq.totalId - warriors.id[w], loyalty, inv.swords, inv.bombs, inv.usedArrows, inv.freshArrows });
+            found++;
         }
     }
+    return found == warriors.live();
 }
 
-void resolveBattles(int time) {
+int World::steadyPeriods(int t, int until) {
+    SteadyState& s = steady;
+    if (redHQ.stopped && blueHQ.stopped) {
+        s.reset();
+        return 0;
+    }
+    int hour = t / 60;
+    Headquarters* hqs[2] = { &blueHQ, &redHQ };
+    if (!s.period) {
+        int battles = static_cast<int>(outcome.battles - s.hourBattles);
+        s.hourBattles = outcome.battles;
+        if (s.skip > 0) {
+            s.skip--;
+            return 0;
+        }
+        s.key.clear();
+        for (const Headquarters* hq : hqs) s.key.insert(s.key.end(), { hq->stopped, hq->nextId, hq->totalId % 3 });
+        s.key.push_back(warriors.live());
+        s.key.push_back(battles);
+        s.keys.push_back(fnv1a(s.key));
+        if (static_cast<int>(s.keys.size()) > 2 * SteadyState::MAX_PERIOD) s.keys.pop_front();
+        s.period = s.repeatedLag();
+        if (!s.period) return 0;
+        if (!steadySignature(s.signature)) {
+            s.miss();
+            return 0;
+        }
+        s.start = -1;
+    }
+    if (s.start >= 0 && hour >= s.start + s.period) {
+        if (!steadySignature(s.current) || s.current != s.signature) {
+            s.miss();
+            return 0;
+        }
+        int limit = min(until, T);
+        if (snapshot && snapshotAt >= t) limit = min(limit, snapshotAt - 1);
+        if (snapshot && snapshotEvery > 0) limit = min(limit, (t / snapshotEvery + 1) * snapshotEvery - 2);
+        long long k = ((limit + 1) / 60 - hour) / s.period;
+        if (k > 0) return steadyBound(k);
+        // Too close to a snapshot or the end of the run: record the period again from here.
+        s.start = -1;
+    }
+    if (s.start < 0) {
+        s.start = hour;
+        for (int side = 0; side < 2; side++) {
+            s.life[side] = hqs[side]->life;
+            s.totalId[side] = hqs[side]->totalId;
+            s.hourLife[side].clear();
+            s.hourNext[side].clear();
+        }
+        s.events.clear();
+        s.battles = outcome.battles;
+        if (stats) s.stats = *stats;
+    }
+    for (int side = 0; side < 2; side++) {
+        s.hourLife[side].push_back(hqs[side]->life);
+        s.hourNext[side].push_back(hqs[side]->nextId);
+    }
+    return 0;
+}
+
+int World::steadyBound(long long k) {
+    SteadyState& s = steady;
+    Headquarters* hqs[2] = { &blueHQ, &redHQ };
+    int period = s.period;
+    long long cap = llabs(K) * (N + 1LL);
+    int* dLife = s.dLife;
+    int* dId = s.dId;
+    for (int side = 0; side < 2; side++) {
+        const Headquarters& hq = *hqs[side];
+        dLife[side] = hq.life - s.life[side];
+        dId[side] = hq.totalId - s.totalId[side];
+        if (dLife[side] == 0) continue;
+        long long drop = -static_cast<long long>(dLife[side]);
+        auto bound = [&k, drop](long long margin) {
+            k = margin < 0 ? 0 : min(k, margin / drop);
+        };
+        for (int j = 0; j < period && !hq.stopped; j++) {
+            WarriorType type = hq.productionOrder[s.hourNext[side][j]];
+            long long after = s.hourLife[side][j] - initialLife[type];
+            bound(after);
+            if (type == LION) bound(after > cap ? after - cap - 1 : -1);
+        }
+        for (int w = 0; w < warriors.size(); w++) {
+            if (warriors.alive[w] && warriors.isRed[w] == side && warriors.type[w] == LION)
+                bound(warriors.loyalty[w] > cap ? warriors.loyalty[w] - cap - 1 : -1);
+        }
+    }
+    if (k <= 0) {
+        s.miss();
+        return 0;
+    }
+
+    return static_cast<int>(k);
+}
+
+void World::extrapolate(int t, int periods, ostream& out, EventLogWriter* log) {
+    TraceWriter::TimePoint start = trace ? chrono::steady_clock::now() : TraceWriter::TimePoint();
+    SteadyState& s = steady;
+    Headquarters* hqs[2] = { &blueHQ, &redHQ };
+    const int* dLife = s.dLife;
+    const int* dId = s.dId;
+    int period = s.period;
+    long long k = periods;
+    for (int m = 1; m <= periods; m++) {
+        for (Event e : s.events) {
+            e.time += m * period * 60;
+            e.actorId += m * dId[e.isRed];
+            if (e.kind == STOLE || e.kind == DRAW || e.kind == KILLED || e.kind == BOTH_DIED) e.targetId += m * dId[!e.isRed];
+            if (e.kind == HQ_REPORT || (e.kind == BORN && e.actorType == LION)) {
+                int& value = e.kind == HQ_REPORT ? e.hp : e.loyalty;
+                value += m * dLife[e.isRed];
+            }
+            if (!filter.accepts(e, N)) continue;
+            if (stats) stats->eventTypes[e.type()]++;
+            emit(e, log);
+        }
+        if (text.size() >= TextBuffer::FLUSH_SIZE) text.flush(out);
+    }
+
+    if (stats) {
+        for (int p = 0; p < PHASE_COUNT; p++) stats->events[p] += k * (stats->events[p] - s.stats.events[p]);
+        stats->battles += k * (stats->battles - s.stats.battles);
+        stats->battleRounds += k * (stats->battleRounds - s.stats.battleRounds);
+        stats->warriorsCreated += k * (stats->warriorsCreated - s.stats.warriorsCreated);
+        stats->weaponsCreated += k * (stats->weaponsCreated - s.stats.weaponsCreated);
+        stats->extrapolatedHours += k * period;
+    }
+    outcome.battles += k * (outcome.battles - s.battles);
+    for (int side = 0; side < 2; side++) {
+        hqs[side]->life += periods * dLife[side];
+        hqs[side]->totalId += periods * dId[side];
+    }
+    for (int w = 0; w < warriors.size(); w++) {
+        if (!warriors.alive[w]) continue;
+        int side = warriors.isRed[w] != 0;
+        warriors.id[w] += periods * dId[side];
+        if (warriors.type[w] == LION) warriors.loyalty[w] += periods * dLife[side];
+    }
+    nextTime = t + periods * period * 60;
+    // The state is still periodic: keep the period and record it again from here.
+    s.start = -1;
+    s.misses = 0;
+    if (trace) trace->complete("extrapolate", "phase", start, chrono::steady_clock::now(), { { "time", t }, { "period", period }, { "hours", k * period } });
+}
+
+void World::save(SnapshotWriter& out, int cas, int time) const {
+    out.mark(cas, time);
+    out.put(cas);
+    out.put(time);
+    out.put(M);
+    out.put(N);
+    out.put(K);
+    out.put(T);
+    for (int i = 0; i < 5; i++) out.put(initialLife[i]);
+    for (int i = 0; i < 5; i++) out.put(initialAttack[i]);
+    for (WarriorType type : redHQ.productionOrder) out.put(type);
+    for (WarriorType type : blueHQ.productionOrder) out.put(type);
+    for (const Headquarters* hq : { &redHQ, &blueHQ }) {
+        out.put(hq->life);
+        out.put(hq->nextId);
+        out.put(hq->totalId);
+        out.put(hq->stopped);
+        out.put(hq->istaken);
+    }
+    warriors.save(out);
+    out.put(cityWarriors.size());
+    for (auto& entry : cityWarriors) {
+        out.put(entry.first);
+        out.put(entry.second);
+    }
+}
+
+bool World::load(SnapshotReader& in, int& cas, int& time) {
+    CaseParams params;
+    cas = in.get();
+    time = in.get(-1, numeric_limits<int>::max());
+    params.M = in.get();
+    params.N = in.get(0, numeric_limits<int>::max() - 2);
+    params.K = in.get();
+    params.T = in.get();
+    for (int i = 0; i < 5; i++) params.initialLife[i] = in.get();
+    for (int i = 0; i < 5; i++) params.initialAttack[i] = in.get();
+    for (int i = 0; i < 5; i++) params.redOrder[i] = static_cast<WarriorType>(in.get(DRAGON, WOLF));
+    for (int i = 0; i < 5; i++) params.blueOrder[i] = static_cast<WarriorType>(in.get(DRAGON, WOLF));
+    if (!in.good()) return false;
+    reset(params);
+    for (Headquarters* hq : { &redHQ, &blueHQ }) {
+        hq->life = in.get();
+        hq->nextId = in.get(0, 4);
+        hq->totalId = in.get();
+        hq->stopped = in.get(0, 1);
+        hq->istaken = in.get(0, 1);
+    }
+    if (!warriors.load(in)) return false;
+    int cities = in.get(0, N + 2);
+    if (cities != 0 && cities != N + 2) return false;
+    cityWarriors.resize(cities);
     for (auto& entry : cityWarriors) {
-        int city = entry.first;
-        Warrior* red = entry.second.first;
-        Warrior* blue = entry.second.second;
-
-        if (red && blue) {
-            fight(red, blue, city, time);
-            if (find(redWarriors.begin(), redWarriors.end(), red) == redWarriors.end()) {
-                entry.second.first = nullptr;
+        entry.first = in.get(-1, warriors.size() - 1);
+        entry.second = in.get(-1, warriors.size() - 1);
+    }
+    nextTime = time < 0 ? 0 : nextTick(time);
+    idle = false;
+    clock = time;
+    return in.good();
+}
+
+void World::beginCase(int cas, EventLogWriter* log) {
+    if (async) async->beginCase(cas);
+    else if (log) log->beginCase(cas);
+    else if (!silent) {
+        text.put("Case ", 5);
+        text.putInt(cas);
+        text.put(":\n", 2);
+    }
+    warriorsBefore = stats ? stats->warriorsCreated : 0;
+    weaponsBefore = stats ? stats->weaponsCreated : 0;
+}
+
+int World::tick(int cas, int t, ostream& out, EventLogWriter* log) {
+    Phase phase = phaseAt(t % 60);
+    {
+        PhaseTimer timer(stats, phase, trace, t);
+        runPhase(phase, t);
+    }
+    return finishTick(cas, t, phase, out, log);
+}
+
+int World::finishTick(int cas, int t, Phase phase, ostream& out, EventLogWriter* log) {
+    if (stats) stats->events[phase] += events.size();
+    {
+        PhaseTimer timer(stats, OUTPUT, trace, t);
+        flushEvents(out, log);
+    }
+    if (redHQ.istaken || blueHQ.istaken) {
+        outcome.captureTime = t;
+        return T + 1;
+    }
+    if (redHQ.stopped && blueHQ.stopped && warriors.live() == 0) {
+        idle = true;
+        int from = t + 5;
+        return from - from % 60 + (from % 60 <= 50 ? 50 : 110);
+    }
+    int next = nextTick(t);
+    if (snapshot && ((t <= snapshotAt && next > snapshotAt) || (snapshotEvery > 0 && next / snapshotEvery > t / snapshotEvery)))
+        save(*snapshot, cas, t);
+    return next;
+}
+
+void World::updateOutcome() {
+    outcome.redTaken = redHQ.istaken;
+    outcome.blueTaken = blueHQ.istaken;
+    outcome.redAlive = outcome.blueAlive = 0;
+    for (int w = 0; w < warriors.size(); w++) {
+        if (!warriors.alive[w]) continue;
+        if (warriors.isRed[w]) outcome.redAlive++;
+        else outcome.blueAlive++;
+    }
+}
+
+void World::endCase(ostream& out) {
+    text.flush(out);
+    clock = T;
+    updateOutcome();
+
+    if (stats) {
+        long long weaponsHeld = 0;
+        for (int w = 0; w < warriors.size(); w++) {
+            if (warriors.alive[w]) weaponsHeld += warriors.weapons[w].size();
+        }
+        stats->warriorsDestroyed += stats->warriorsCreated - warriorsBefore - warriors.live();
+        stats->weaponsDestroyed += stats->weaponsCreated - weaponsBefore - weaponsHeld;
+    }
+}
+
+void World::runTicks(int cas, int until, ostream& out, EventLogWriter* log) {
+    while (nextTime <= min(until, T)) {
+        if (idle) {
+            PhaseTimer timer(stats, HQ_REPORTS, trace, nextTime);
+            nextTime = reportIdleHours(nextTime, min(until, T), out, log);
+            continue;
+        }
+        if (nextTime % 60 == 0) {
+            int periods;
+            {
+                PhaseTimer timer(stats, STEADY_STATE, trace, nextTime);
+                periods = steadyPeriods(nextTime, until);
+            }
+            if (periods > 0) {
+                PhaseTimer timer(stats, OUTPUT, trace, nextTime);
+                extrapolate(nextTime, periods, out, log);
+                continue;
             }
-            if (find(blueWarriors.begin(), blueWarriors.end(), blue) == blueWarriors.end()) {
-                entry.second.second = nullptr;
+        }
+        nextTime = tick(cas, nextTime, out, log);
+    }
+}
+
+void World::runUntil(int until) {
+    ostream none(nullptr);
+    bool wasSilent = silent;
+    silent = true;
+    runTicks(0, until, none, nullptr);
+    silent = wasSilent;
+    clock = max(clock, until);
+    if (finished()) {
+        clock = outcome.captureTime >= 0 ? outcome.captureTime : T;
+        updateOutcome();
+    }
+}
+
+void World::step(int minutes) {
+    runUntil(clock + minutes);
+}
+
+void World::simulate(int cas, ostream& out, EventLogWriter* log) {
+    TraceWriter::TimePoint start = trace ? chrono::steady_clock::now() : TraceWriter::TimePoint();
+    beginCase(cas, log);
+    runTicks(cas, T, out, log);
+    endCase(out);
+    if (trace) {
+        trace->complete("case " + to_string(cas), "case", start, chrono::steady_clock::now(),
+                        { { "case", cas }, { "M", M }, { "N", N }, { "K", K }, { "T", T }, { "battles", outcome.battles } });
+    }
+}
+
+bool World::replay(int cas, istream& recorded, ostream& out, EventLogWriter* log) {
+    TraceWriter::TimePoint start = trace ? chrono::steady_clock::now() : TraceWriter::TimePoint();
+    beginCase(cas, log);
+    EventLogReader reader(recorded, false);
+    Event e;
+    int mark;
+    {
+        PhaseTimer timer(stats, OUTPUT, trace, T);
+        while (reader.next(e, mark)) {
+            if (mark || e.time > T) continue;
+            if (stats) {
+                if (filter.wants(e.kind)) stats->events[kindPhases[e.kind]]++;
+                if (e.kind == BORN) stats->warriorsCreated++;
+                if (e.kind == RAN_AWAY || e.kind == KILLED) stats->warriorsDestroyed++;
+                if (e.kind == BOTH_DIED) stats->warriorsDestroyed += 2;
+                if (e.kind == DRAW || e.kind == KILLED || e.kind == BOTH_DIED) stats->battles++;
             }
+            if (!filter.accepts(e, N)) continue;
+            if (stats) stats->eventTypes[e.type()]++;
+            emit(e, log);
+            if (text.size() >= TextBuffer::FLUSH_SIZE) text.flush(out);
+        }
+    }
+    text.flush(out);
+    if (trace) trace->complete("replay " + to_string(cas), "case", start, chrono::steady_clock::now(), { { "case", cas }, { "T", T } });
+    return reader.good();
+}
+
+void World::describe(TextBuffer& out, int time, int cityLo, int cityHi) const {
+    for (const Headquarters* hq : { &redHQ, &blueHQ }) {
+        out.putTime(time);
+        out.put(sideNames[hq->isRed]);
+        out.put(" headquarter with ", 18);
+        out.putInt(hq->life);
+        out.put(" elements", 9);
+        if (hq->istaken) out.put(", taken", 7);
+        out.put('\n');
+    }
+    vector<pair<pair<int, int>, int>> present;
+    for (int w = 0; w < warriors.size(); w++) {
+        if (warriors.alive[w] && warriors.city[w] >= cityLo && warriors.city[w] <= cityHi)
+            present.push_back(make_pair(make_pair(warriors.city[w], !warriors.isRed[w]), w));
+    }
+    sort(present.begin(), present.end());
+    for (auto& entry : present) {
+        int w = entry.second;
+        const Inventory& inv = warriors.weapons[w];
+        out.putTime(time);
+        out.put(warriorLabels[warriors.isRed[w] != 0][warriors.type[w]]);
+        out.putInt(warriors.id[w]);
+        out.put(" in city ", 9);
+        out.putInt(warriors.city[w]);
+        out.put(" with ", 6);
+        out.putInt(warriors.hp[w]);
+        out.put(" elements and force ", 20);
+        out.putInt(warriors.attackPower[w]);
+        if (warriors.type[w] == LION) {
+            out.put(", loyalty ", 10);
+            out.putInt(warriors.loyalty[w]);
+        }
+        out.put(", ", 2);
+        out.putInt(inv.swords);
+        out.put(" sword ", 7);
+        out.putInt(inv.bombs);
+        out.put(" bomb ", 6);
+        out.putInt(inv.usedArrows + inv.freshArrows);
+        out.put(" arrow (", 8);
+        out.putInt(inv.usedArrows);
+        out.put(" used)\n", 7);
+    }
+}
+
+class InputScanner {
+public:
+    explicit InputScanner(istream& in) : pos(0), ok(true) {
+        char chunk[1 << 16];
+        streamsize n;
+        while ((n = in.rdbuf()->sgetn(chunk, sizeof(chunk))) > 0)
+            data.append(chunk, n);
+    }
+
+    bool good() const {
+        return ok;
+    }
+
+    int readInt() {
+        while (pos < data.size() && isspace(static_cast<unsigned char>(data[pos])))
+            pos++;
+        bool negative = pos < data.size() && data[pos] == '-';
+        if (negative || (pos < data.size() && data[pos] == '+')) pos++;
+        if (pos >= data.size() || !isdigit(static_cast<unsigned char>(data[pos]))) {
+            ok = false;
+            return 0;
+        }
+        int value = 0;
+        while (pos < data.size() && isdigit(static_cast<unsigned char>(data[pos])))
+            value = value * 10 + (data[pos++] - '0');
+        return negative ? -value : value;
+    }
+
+private:
+    string data;
+    size_t pos;
+    bool ok;
+};
+
+bool readCase(InputScanner& in, CaseParams& p) {
+    p.M = in.readInt();
+    p.N = in.readInt();
+    p.K = in.readInt();
+    p.T = in.readInt();
+    for (int i = 0; i < 5; ++i) p.initialLife[i] = in.readInt();
+    for (int i = 0; i < 5; ++i) p.initialAttack[i] = in.readInt();
+    return in.good();
+}
+
+struct CaseResult {
+    string output;
+    RunStats stats;
+};
+
+CaseResult runCase(int cas, const CaseParams& params, bool binary, ThreadPool* battlePool, bool collectStats, const EventFilter& filter, TraceWriter* trace) {
+    static thread_local World world{CaseParams{}};
+    CaseResult result;
+    ostringstream out;
+    EventLogWriter log(out);
+    world.reset(params);
+    world.battlePool = battlePool;
+    world.stats = collectStats ? &result.stats : nullptr;
+    world.filter = filter;
+    world.trace = trace;
+    world.simulate(cas, out, binary ? &log : nullptr);
+    result.output = out.str();
+    return result;
+}
+
+const char* sweepFields[] = {
+    "M", "N", "K", "T",
+    "life.dragon", "life.ninja", "life.iceman", "life.lion", "life.wolf",
+    "attack.dragon", "attack.ninja", "attack.iceman", "attack.lion", "attack.wolf"
+};
+const int SWEEP_FIELDS = 14;
+
+int& sweepField(CaseParams& p, int field) {
+    switch (field) {
+        case 0: return p.M;
+        case 1: return p.N;
+        case 2: return p.K;
+        case 3: return p.T;
+    }
+    return field < 9 ? p.initialLife[field - 4] : p.initialAttack[field - 9];
+}
+
+struct SweepAxis {
+    vector<int> fields;
+    int lo, hi, step;
+
+    int size() const {
+        return (hi - lo) / step + 1;
+    }
+};
+
+bool parseSweepAxis(const string& spec, SweepAxis& axis) {
+    size_t eq = spec.find('=');
+    if (eq == string::npos) return false;
+    string name = spec.substr(0, eq);
+    axis.fields.clear();
+    for (int f = 0; f < SWEEP_FIELDS; f++) {
+        string field = sweepFields[f];
+        if (field == name || field.compare(0, name.size() + 1, name + ".") == 0)
+            axis.fields.push_back(f);
+    }
+    if (axis.fields.empty()) return false;
+
+    istringstream range(spec.substr(eq + 1));
+    char sep;
+    if (!(range >> axis.lo)) return false;
+    axis.hi = axis.lo;
+    axis.step = 1;
+    if (range >> sep) {
+        if (sep != ':' || !(range >> axis.hi)) return false;
+        if (range >> sep && (sep != ':' || !(range >> axis.step))) return false;
+    }
+    return axis.step > 0 && axis.hi >= axis.lo && range.eof();
+}
+
+bool parseClock(const string& text, int& time) {
+    istringstream when(text);
+    int hours = -1, minutes = -1;
+    char sep = 0;
+    when >> hours >> sep >> minutes;
+    if (!when || sep != ':' || hours < 0 || minutes < 0 || minutes > 59 || hours > numeric_limits<int>::max() / 60 - 1) return false;
+    time = hours * 60 + minutes;
+    char extra;
+    return !(when >> extra);
+}
+
+string formatClock(int time) {
+    ostringstream text;
+    text << setw(3) << setfill('0') << time / 60 << ':' << setw(2) << time % 60;
+    return text.str();
+}
+
+bool queryReplay(const string& path, int cas, int time, int cityLo, int cityHi, ostream& os) {
+    ifstream file(path, ios::binary);
+    vector<SnapshotIndexEntry> index;
+    if (!file || !SnapshotReader::readIndex(file, index)) {
+        cerr << "invalid replay index: " << path << endl;
+        return false;
+    }
+
+    const SnapshotIndexEntry* best = nullptr;
+    for (auto& entry : index) {
+        if (entry.cas == cas && entry.time <= time && (!best || entry.time > best->time))
+            best = &entry;
+    }
+    if (!best) {
+        cerr << "no keyframe for case " << cas << " at " << formatClock(time) << " in " << path << endl;
+        return false;
+    }
+
+    file.clear();
+    file.seekg(best->offset);
+    SnapshotReader reader(file, false);
+    World world(CaseParams{});
+    int loadedCase, loadedTime;
+    if (!world.load(reader, loadedCase, loadedTime)) {
+        cerr << "invalid replay index: " << path << endl;
+        return false;
+    }
+    world.silent = true;
+    world.filter.kinds = 0;
+    ostream none(nullptr);
+    world.runTicks(cas, time, none, nullptr);
+    int end = world.outcome.captureTime >= 0 ? world.outcome.captureTime : world.T;
+    if (time > end) {
+        cerr << "case " << cas << " ends at " << formatClock(end) << endl;
+        return false;
+    }
+
+    TextBuffer text;
+    text.put("Case ", 5);
+    text.putInt(cas);
+    text.put(":\n", 2);
+    world.describe(text, time, cityLo, cityHi);
+    text.flush(os);
+    return true;
+}
+
+class ResultCache {
+public:
+    explicit ResultCache(const string& dir) : dir(dir), warned(false) {}
+
+    const string* find(const CaseParams& params) {
+        uint64_t key = hash(params);
+        auto it = entries.find(key);
+        if (it == entries.end() || !sameCase(it->second.params, params)) {
+            if (dir.empty() || !loadEntry(key, params)) return nullptr;
+            it = entries.find(key);
+        }
+        return it->second.params.T >= params.T ? &it->second.log : nullptr;
+    }
+
+    const string& store(const CaseParams& params, string log) {
+        uint64_t key = hash(params);
+        Entry& entry = entries[key];
+        entry.params = params;
+        entry.log = move(log);
+        if (!dir.empty()) saveEntry(key, entry);
+        return entry.log;
+    }
+
+private:
+    struct Entry {
+        CaseParams params;
+        string log;
+    };
+
+    string dir;
+    map<uint64_t, Entry> entries;
+    bool warned;
+
+    static vector<int> fields(const CaseParams& p) {
+        vector<int> values = { p.M, p.N, p.K };
+        values.insert(values.end(), p.initialLife, p.initialLife + 5);
+        values.insert(values.end(), p.initialAttack, p.initialAttack + 5);
+        values.insert(values.end(), p.redOrder, p.redOrder + 5);
+        values.insert(values.end(), p.blueOrder, p.blueOrder + 5);
+        return values;
+    }
+
+    static uint64_t hash(const CaseParams& p) {
+        return fnv1a(fields(p));
+    }
+
+    static bool sameCase(const CaseParams& a, const CaseParams& b) {
+        return fields(a) == fields(b);
+    }
+
+    string path(uint64_t key) const {
+        ostringstream name;
+        name << dir << "/" << hex << setw(16) << setfill('0') << key << ".mwc";
+        return name.str();
+    }
+
+    bool loadEntry(uint64_t key, const CaseParams& params) {
+        ifstream file(path(key), ios::binary);
+        char magic[8];
+        file.read(magic, 8);
+        if (!file || string(magic, 8) != "MWCACHE1") return false;
+        SnapshotReader reader(file, false);
+        for (int v : fields(params)) {
+            if (reader.get() != v) return false;
         }
+        int T = reader.get();
+        int size = reader.get(0, numeric_limits<int>::max());
+        if (!reader.good()) return false;
+        string log(size, '\0');
+        file.read(&log[0], size);
+        if (!file) return false;
+        istringstream recorded(log);
+        EventLogReader events(recorded, false);
+        Event e;
+        int mark;
+        while (events.next(e, mark)) {}
+        if (!events.good()) return false;
+        Entry& entry = entries[key];
+        entry.params = params;
+        entry.params.T = T;
+        entry.log = move(log);
+        return true;
+    }
+
+    void saveEntry(uint64_t key, const Entry& entry) {
+        string target = path(key);
+        string temp = target + ".tmp";
+        ofstream file(temp, ios::binary);
+        file.write("MWCACHE1", 8);
+        SnapshotWriter writer(file);
+        for (int v : fields(entry.params)) writer.put(v);
+        writer.put(entry.params.T);
+        writer.put(static_cast<int>(entry.log.size()));
+        file.write(entry.log.data(), entry.log.size());
+        file.close();
+        if (file && rename(temp.c_str(), target.c_str()) == 0) return;
+        remove(temp.c_str());
+        if (!warned) cerr << "cannot write cache entry " << target << endl;
+        warned = true;
     }
+};
+
+void simulateCached(World& world, ResultCache& cache, int cas, const CaseParams& params, ostream& out, EventLogWriter* log) {
+    const string* recorded = cache.find(params);
+    RunStats* stats = world.stats;
+    TraceWriter* trace = world.trace;
+    if (recorded && stats) stats->cacheHits++;
+    if (!recorded) {
+        ostringstream captured;
+        EventLogWriter capture(captured);
+        EventFilter wanted = world.filter;
+        AsyncWriter* async = world.async;
+        RunStats before = stats ? *stats : RunStats();
+        world.filter = EventFilter();
+        world.async = nullptr;
+        world.simulate(cas, out, &capture);
+        world.filter = wanted;
+        world.async = async;
+        // Count the case from the replay below, exactly as a hit would; only the time spent stays.
+        if (stats) {
+            RunStats ran = *stats;
+            *stats = before;
+            copy(ran.seconds, ran.seconds + PHASE_COUNT, stats->seconds);
+            copy(ran.calls, ran.calls + PHASE_COUNT, stats->calls);
+        }
+        world.trace = nullptr;
+
+        CaseParams key = params;
+        if (world.outcome.redTaken || world.outcome.blueTaken) key.T = numeric_limits<int>::max();
+        recorded = &cache.store(key, captured.str());
+    }
+    istringstream in(*recorded);
+    world.replay(cas, in, out, log);
+    world.trace = trace;
+}
+
+Outcome runOutcome(const CaseParams& params) {
+    static thread_local World world{CaseParams{}};
+    ostream none(nullptr);
+    world.reset(params);
+    world.silent = true;
+    world.filter.kinds = 0;
+    world.simulate(0, none, nullptr);
+    return world.outcome;
 }
 
-void reportHeadquarters(int time) {
-    events.emplace_back(time, 0, 8, to_string(redHQ->life) + " elements in red headquarter");
-    events.emplace_back(time, N + 1, 8, to_string(blueHQ->life) + " elements in blue headquarter");
+void printOutcome(ostream& os, const CaseParams& params, const Outcome& o) {
+    CaseParams p = params;
+    for (int f = 0; f < SWEEP_FIELDS; f++) os << sweepField(p, f) << ",";
+    const char* winner = o.redTaken && o.blueTaken ? "both" : o.blueTaken ? "red" : o.redTaken ? "blue" : "none";
+    os << winner << "," << o.captureTime << "," << o.redAlive << "," << o.blueAlive << "," << o.battles << "\n";
 }
 
-void reportWeapons(int time) {
-    auto report = [time](const vector<Warrior*>& warriors, bool isRed) {
-        for (auto w : warriors) {
-            string msg = (isRed ? "red " : "blue ") + warriorNames[w->type] + " " + to_string(w->id) + " has " + w->reportWeapons() + " and " + to_string(w->hp) + " elements";
-            events.emplace_back(time, w->city, 9, msg);
+int runSweep(const vector<SweepAxis>& axes, int jobs, ostream& out) {
+    bool covered[SWEEP_FIELDS] = {};
+    long long total = 1;
+    for (auto& axis : axes) {
+        for (int f : axis.fields) covered[f] = true;
+        total *= axis.size();
+        if (total > numeric_limits<int>::max()) {
+            cerr << "sweep too large" << endl;
+            return 1;
         }
+    }
+    for (int f = 0; f < SWEEP_FIELDS; f++) {
+        if (!covered[f]) {
+            cerr << "sweep is missing " << sweepFields[f] << endl;
+            return 1;
+        }
+    }
+
+    for (int f = 0; f < SWEEP_FIELDS; f++) out << sweepFields[f] << ",";
+    out << "winner,captureTime,redAlive,blueAlive,battles\n";
+
+    ThreadPool pool(jobs);
+    deque<pair<CaseParams, future<Outcome>>> pending;
+    auto finish = [&] {
+        printOutcome(out, pending.front().first, pending.front().second.get());
+        pending.pop_front();
     };
+    for (long long i = 0; i < total; i++) {
+        CaseParams params;
+        vector<int> values(axes.size());
+        long long rest = i;
+        for (int a = axes.size() - 1; a >= 0; a--) {
+            values[a] = axes[a].lo + rest % axes[a].size() * axes[a].step;
+            rest /= axes[a].size();
+        }
+        for (size_t a = 0; a < axes.size(); a++) {
+            for (int f : axes[a].fields) sweepField(params, f) = values[a];
+        }
+        pending.emplace_back(params, pool.submit([params] { return runOutcome(params); }));
+        while (pending.size() > static_cast<size_t>(jobs) * 16) finish();
+    }
+    while (!pending.empty()) finish();
+    out.flush();
+    return 0;
+}
 
-    report(redWarriors, true);
-    report(blueWarriors, false);
+void printCaseStats(ostream& os, int cas, const RunStats& stats) {
+    os << "{\"scope\":\"case\",\"case\":" << cas << ",";
+    stats.writeJson(os);
+    os << "}" << endl;
 }
 
-void simulate(int cas) {
-    cout << "Case " << cas << ":" << endl;
-    for (int t = 0; t <= T; t+=5) {
-        int minutes = t % 60;
+void printTotalStats(ostream& os, int cases, const RunStats& stats) {
+    os << "{\"scope\":\"total\",\"cases\":" << cases << ",";
+    stats.writeJson(os);
+    os << "}" << endl;
+}
 
-        if (minutes == 0) {
-            produceWarriors(t);
-        } else if (minutes == 5) {
-            checkLionEscape(t);
-        } else if (minutes == 10) {
-            moveWarriors(t);
-            if (redHQ->istaken || blueHQ->istaken) {
-                break;
+#ifndef MONSTERWORLD_NO_MAIN
+int main(int argc, char* argv[]) {
+    ios::sync_with_stdio(false);
+    string binlogPath, tracePath;
+    int jobs = 0;
+    int battleThreads = 0;
+    bool statsJson = false;
+    bool asyncOutput = false;
+    string snapshotPath, resumePath, queryPath;
+    int snapshotAt = -1;
+    bool replayIndex = false;
+    int keyframeHours = 10;
+    int queryCase = 0, queryTime = 0;
+    vector<SweepAxis> sweep;
+    bool sweeping = false;
+    bool caching = false;
+    string cacheDir;
+    EventFilter filter;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--binlog" && i + 1 < argc) {
+            binlogPath = argv[++i];
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = max(1, atoi(argv[++i]));
+        } else if (arg == "--battle-threads" && i + 1 < argc) {
+            battleThreads = max(0, atoi(argv[++i]));
+        } else if (arg == "--stats=json") {
+            statsJson = true;
+        } else if (arg == "--async") {
+            asyncOutput = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (arg == "--snapshot-at" && i + 2 < argc) {
+            if (!parseClock(argv[++i], snapshotAt)) {
+                cerr << "invalid time: " << argv[i] << " (expected HHH:MM)" << endl;
+                return 1;
+            }
+            snapshotPath = argv[++i];
+        } else if (arg == "--events" && i + 1 < argc) {
+            if (!filter.parseKinds(argv[++i])) {
+                cerr << "unknown event kind in " << argv[i] << " (born escape march reach steal battle hq weapons)" << endl;
+                return 1;
+            }
+        } else if (arg == "--side" && i + 1 < argc) {
+            string side = argv[++i];
+            filter.red = side == "red";
+            filter.blue = side == "blue";
+            if (!filter.red && !filter.blue) {
+                cerr << "invalid side: " << side << endl;
+                return 1;
+            }
+        } else if (arg == "--cities" && i + 1 < argc) {
+            char sep = 0;
+            istringstream range(argv[++i]);
+            range >> filter.cityLo >> sep >> filter.cityHi;
+            if (!range || sep != ':') {
+                cerr << "invalid city range: " << argv[i] << endl;
+                return 1;
+            }
+        } else if (arg == "--warrior" && i + 1 < argc) {
+            filter.ids.push_back(atoi(argv[++i]));
+        } else if (arg == "--sweep") {
+            sweeping = true;
+            while (i + 1 < argc && argv[i + 1][0] != '-') {
+                SweepAxis axis;
+                if (!parseSweepAxis(argv[++i], axis)) {
+                    cerr << "invalid sweep range: " << argv[i] << endl;
+                    return 1;
+                }
+                sweep.push_back(axis);
+            }
+        } else if (arg == "--replay-index" && i + 1 < argc) {
+            replayIndex = true;
+            snapshotPath = argv[++i];
+        } else if (arg == "--keyframe-hours" && i + 1 < argc) {
+            keyframeHours = max(1, atoi(argv[++i]));
+        } else if (arg == "--query" && i + 3 < argc) {
+            queryPath = argv[++i];
+            queryCase = atoi(argv[++i]);
+            if (!parseClock(argv[++i], queryTime)) {
+                cerr << "invalid time: " << argv[i] << " (expected HHH:MM)" << endl;
+                return 1;
+            }
+        } else if (arg == "--cache") {
+            caching = true;
+        } else if (arg == "--cache-dir" && i + 1 < argc) {
+            caching = true;
+            cacheDir = argv[++i];
+        } else if (arg == "--resume" && i + 1 < argc) {
+            resumePath = argv[++i];
+        } else if (arg == "--render" && i + 1 < argc) {
+            ifstream file(argv[++i], ios::binary);
+            EventLogReader reader(file);
+            if (!reader.good() || !reader.render(cout)) {
+                cerr << "invalid event log: " << argv[i] << endl;
+                return 1;
             }
-        } else if (minutes == 35) {
-            resolveWolfSteal(t);
-        } else if (minutes == 40) {
-            resolveBattles(t);
-        } else if (minutes == 50) {
-            reportHeadquarters(t);
-        } else if (minutes == 55) {
-            reportWeapons(t);
+            return 0;
+        } else {
+            cerr << "usage: " << argv[0] << " [--jobs N | --async] [--battle-threads N] [--stats=json] [--trace FILE] [--events LIST] [--side red|blue] [--cities LO:HI] [--warrior ID]... [--snapshot-at HHH:MM FILE | --resume FILE | --cache | --cache-dir DIR] [--binlog FILE | --render FILE]" << endl;
+            cerr << "       " << argv[0] << " [--replay-index FILE [--keyframe-hours H]] < input" << endl;
+            cerr << "       " << argv[0] << " --query FILE CASE HHH:MM [--cities LO:HI]" << endl;
+            cerr << "       " << argv[0] << " [--jobs N] --sweep FIELD=LO[:HI[:STEP]]..." << endl;
+            return 1;
         }
     }
 
-    sort(events.begin(), events.end());
-    for (auto& e : events) {
-        if (e.time > T) continue;
-        int hours = e.time / 60;
-        int minutes = e.time % 60;
-        cout << setw(3) << setfill('0') << hours << ":" << setw(2) << setfill('0') << minutes << " " << e.message << endl;
+    if (replayIndex && snapshotAt >= 0) {
+        cerr << "--replay-index and --snapshot-at cannot be combined" << endl;
+        return 1;
+    }
+    if (caching && (!snapshotPath.empty() || !resumePath.empty())) {
+        cerr << "--cache cannot be combined with snapshots or --resume" << endl;
+        return 1;
     }
-}
 
-int main() {
-    int cases;
-    cin >> cases;
-    int cas = 1;
-    while(cas <= cases) {
-        events.clear();
-        cin >> M >> N >> K >> T;
-        for (int i = 0; i < 5; ++i) cin >> initialLife[i];
-        for (int i = 0; i < 5; ++i) cin >> initialAttack[i];
+    if (!queryPath.empty()) {
+        return queryReplay(queryPath, queryCase, queryTime, filter.cityLo, filter.cityHi, cout) ? 0 : 1;
+    }
 
-        redHQ = new Headquarters(M, {ICEMAN, LION, WOLF, NINJA, DRAGON}, true);
-        blueHQ = new Headquarters(M, {LION, DRAGON, NINJA, ICEMAN, WOLF}, false);
+    if (sweeping) {
+        if (jobs == 0) jobs = max(1u, thread::hardware_concurrency());
+        return runSweep(sweep, jobs, cout);
+    }
 
-        simulate(cas);
+    ofstream binlog;
+    if (!binlogPath.empty()) {
+        binlog.open(binlogPath, ios::binary);
+        if (!binlog) {
+            cerr << "cannot open " << binlogPath << endl;
+            return 1;
+        }
+        EventLogWriter::writeHeader(binlog);
+    }
+    bool binary = binlog.is_open();
+    ostream& out = binary ? static_cast<ostream&>(binlog) : cout;
+
+    ofstream traceFile;
+    unique_ptr<TraceWriter> trace;
+    if (!tracePath.empty()) {
+        traceFile.open(tracePath);
+        if (!traceFile) {
+            cerr << "cannot open " << tracePath << endl;
+            return 1;
+        }
+        trace.reset(new TraceWriter(traceFile));
+    }
 
-        delete redHQ;
-        delete blueHQ;
-        redWarriors.clear();
-        blueWarriors.clear();
-        cityWarriors.clear();
-        cas++;
+    unique_ptr<ThreadPool> battlePool;
+    if (battleThreads > 0) battlePool.reset(new ThreadPool(battleThreads));
+
+    RunStats totals;
+    int done = 0;
+    unique_ptr<AsyncWriter> writer;
+    if (asyncOutput && (jobs <= 1 || caching || !resumePath.empty() || !snapshotPath.empty()))
+        writer.reset(new AsyncWriter(out, binary));
+
+    if (!resumePath.empty()) {
+        ifstream file(resumePath, ios::binary);
+        SnapshotReader snapshots(file);
+        EventLogWriter log(out);
+        World world(CaseParams{}, battlePool.get());
+        world.filter = filter;
+        world.async = writer.get();
+        world.trace = trace.get();
+        int cas, time;
+        while (snapshots.good() && !snapshots.atEnd()) {
+            if (!world.load(snapshots, cas, time)) break;
+            RunStats stats;
+            if (statsJson) world.stats = &stats;
+            world.simulate(cas, out, binary ? &log : nullptr);
+            if (statsJson) {
+                printCaseStats(cerr, cas, stats);
+                totals.merge(stats);
+            }
+            done++;
+        }
+        if (statsJson) printTotalStats(cerr, done, totals);
+        if (!snapshots.good()) {
+            cerr << "invalid snapshot: " << resumePath << endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    ofstream snapshotFile;
+    if (!snapshotPath.empty()) {
+        snapshotFile.open(snapshotPath, ios::binary);
+        if (!snapshotFile) {
+            cerr << "cannot open " << snapshotPath << endl;
+            return 1;
+        }
+        SnapshotWriter::writeHeader(snapshotFile);
+    }
+    SnapshotWriter snapshot(snapshotFile);
+
+    InputScanner input(cin);
+    int cases = input.readInt();
+
+    if (jobs <= 1 || caching || snapshotFile.is_open()) {
+        EventLogWriter log(out);
+        ResultCache cache(cacheDir);
+        CaseParams params{};
+        World world(params, battlePool.get());
+        world.filter = filter;
+        world.async = writer.get();
+        world.trace = trace.get();
+        if (snapshotFile.is_open()) {
+            world.snapshot = &snapshot;
+            world.snapshotAt = snapshotAt;
+            if (replayIndex) world.snapshotEvery = keyframeHours * 60;
+        }
+        for (int cas = 1; cas <= cases && readCase(input, params); cas++) {
+            RunStats stats;
+            world.reset(params);
+            if (replayIndex) world.save(snapshot, cas, -1);
+            if (statsJson) world.stats = &stats;
+            if (caching) simulateCached(world, cache, cas, params, out, binary ? &log : nullptr);
+            else world.simulate(cas, out, binary ? &log : nullptr);
+            if (statsJson) {
+                printCaseStats(cerr, cas, stats);
+                totals.merge(stats);
+            }
+            done++;
+        }
+        if (replayIndex) snapshot.writeIndex();
+        if (statsJson) printTotalStats(cerr, done, totals);
+        return 0;
+    }
+
+    ThreadPool pool(jobs);
+    deque<future<CaseResult>> pending;
+    auto finish = [&] {
+        CaseResult result = pending.front().get();
+        pending.pop_front();
+        out << result.output;
+        done++;
+        if (statsJson) {
+            printCaseStats(cerr, done, result.stats);
+            totals.merge(result.stats);
+        }
+    };
+    CaseParams params;
+    for (int cas = 1; cas <= cases && readCase(input, params); cas++) {
+        pending.push_back(pool.submit([cas, params, binary, statsJson, &filter, &battlePool, &trace] {
+            return runCase(cas, params, binary, battlePool.get(), statsJson, filter, trace.get());
+        }));
+        while (pending.size() > static_cast<size_t>(jobs) * 4) finish();
     }
+    while (!pending.empty()) finish();
+    if (statsJson) printTotalStats(cerr, done, totals);
     return 0;
 }
+#endif
@@ -0,0 +1,160 @@
+#define MONSTERWORLD_NO_MAIN
+#include "MonsterWorld.cpp"
+
+#include <random>
+
+using namespace std;
+
+class NullBuffer : public streambuf {
+protected:
+    int overflow(int c) override {
+        return c;
+    }
+
+    streamsize xsputn(const char*, streamsize n) override {
+        return n;
+    }
+};
+
+const char* scenarioNames[] = { "small", "large", "wide", "stalemate", "long" };
+
+bool generateScenario(const string& name, unsigned seed, int cases, vector<CaseParams>& out) {
+    mt19937 rng(seed);
+    auto pick = [&rng](int lo, int hi) {
+        return uniform_int_distribution<int>(lo, hi)(rng);
+    };
+
+    out.clear();
+    for (int i = 0; i < cases; i++) {
+        CaseParams p;
+        if (name == "small") {
+            p.M = pick(20, 200);
+            p.N = pick(1, 5);
+            p.K = pick(1, 10);
+            p.T = pick(100, 1000);
+            for (int j = 0; j < 5; j++) p.initialLife[j] = pick(5, 50);
+            for (int j = 0; j < 5; j++) p.initialAttack[j] = pick(1, 50);
+        } else if (name == "large") {
+            p.M = pick(100000, 1000000);
+            p.N = 20;
+            p.K = pick(1, 20);
+            p.T = 6000;
+            for (int j = 0; j < 5; j++) p.initialLife[j] = pick(10, 100);
+            for (int j = 0; j < 5; j++) p.initialAttack[j] = pick(10, 100);
+        } else if (name == "wide") {
+            p.M = pick(1000000, 5000000);
+            p.N = pick(500, 2000);
+            p.K = pick(0, 5);
+            p.T = 20000;
+            for (int j = 0; j < 5; j++) p.initialLife[j] = pick(50, 500);
+            for (int j = 0; j < 5; j++) p.initialAttack[j] = pick(10, 200);
+        } else if (name == "stalemate") {
+            p.M = pick(100000, 1000000);
+            p.N = 20;
+            p.K = 0;
+            p.T = 6000;
+            for (int j = 0; j < 5; j++) p.initialLife[j] = pick(1000, 5000);
+            for (int j = 0; j < 5; j++) p.initialAttack[j] = pick(0, 9);
+        } else if (name == "long") {
+            p.M = pick(1, 60);
+            p.N = pick(1, 20);
+            p.K = pick(1, 20);
+            p.T = pick(1000000, 5000000);
+            for (int j = 0; j < 5; j++) p.initialLife[j] = pick(10, 60);
+            for (int j = 0; j < 5; j++) p.initialAttack[j] = pick(10, 100);
+        } else {
+            return false;
+        }
+        out.push_back(p);
+    }
+    return true;
+}
+
+void printCases(ostream& os, const vector<CaseParams>& cases) {
+    os << cases.size() << "\n";
+    for (auto& p : cases) {
+        os << p.M << " " << p.N << " " << p.K << " " << p.T << "\n";
+        for (int i = 0; i < 5; i++) os << p.initialLife[i] << (i < 4 ? " " : "\n");
+        for (int i = 0; i < 5; i++) os << p.initialAttack[i] << (i < 4 ? " " : "\n");
+    }
+}
+
+void runBenchmark(const string& name, const vector<CaseParams>& cases, int reps) {
+    NullBuffer sink;
+    ostream out(&sink);
+    RunStats stats;
+    long long events = 0;
+
+    World world(cases[0]);
+    world.stats = &stats;
+
+    auto start = chrono::steady_clock::now();
+    for (int r = 0; r < reps; r++) {
+        for (size_t i = 0; i < cases.size(); i++) {
+            world.reset(cases[i]);
+            world.simulate(i + 1, out, nullptr);
+        }
+    }
+    double total = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (int p = 0; p < OUTPUT; p++) events += stats.events[p];
+
+    int runs = cases.size() * reps;
+    cout << name << ": " << runs << " cases in " << fixed << setprecision(3) << total << " s, "
+         << setprecision(1) << runs / total << " cases/s, " << events / total << " events/s" << endl;
+    cout << "  " << left << setw(20) << "phase" << right << setw(12) << "calls" << setw(12) << "total ms"
+         << setw(12) << "ns/call" << setw(14) << "events/s" << endl;
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        double seconds = stats.seconds[p];
+        long long phaseEvents = p == OUTPUT ? events : stats.events[p];
+        cout << "  " << left << setw(20) << phaseNames[p] << right << setw(12) << stats.calls[p]
+             << setw(12) << setprecision(2) << seconds * 1e3
+             << setw(12) << setprecision(0) << (stats.calls[p] ? seconds * 1e9 / stats.calls[p] : 0.0)
+             << setw(14) << (seconds > 0 ? phaseEvents / seconds : 0.0) << endl;
+    }
+}
+
+int main(int argc, char* argv[]) {
+    string generate;
+    vector<string> scenarios;
+    unsigned seed = 1;
+    int cases = 20;
+    int reps = 1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--generate" && i + 1 < argc) {
+            generate = argv[++i];
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--cases" && i + 1 < argc) {
+            cases = max(1, atoi(argv[++i]));
+        } else if (arg == "--reps" && i + 1 < argc) {
+            reps = max(1, atoi(argv[++i]));
+        } else if (arg[0] != '-') {
+            scenarios.push_back(arg);
+        } else {
+            cerr << "usage: " << argv[0] << " [--generate SCENARIO] [--seed S] [--cases C] [--reps R] [SCENARIO...]" << endl;
+            cerr << "scenarios: small large wide stalemate long" << endl;
+            return 1;
+        }
+    }
+
+    vector<CaseParams> params;
+    if (!generate.empty()) {
+        if (!generateScenario(generate, seed, cases, params)) {
+            cerr << "unknown scenario: " << generate << endl;
+            return 1;
+        }
+        printCases(cout, params);
+        return 0;
+    }
+
+    if (scenarios.empty()) scenarios.assign(begin(scenarioNames), end(scenarioNames));
+    for (auto& name : scenarios) {
+        if (!generateScenario(name, seed, cases, params)) {
+            cerr << "unknown scenario: " << name << endl;
+            return 1;
+        }
+        runBenchmark(name, params, reps);
+    }
+    return 0;
+}